@@ -26,18 +26,27 @@
 #include <string.h>
 #include <limits.h>
 #include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
 
 #ifdef WIN32
 #include <winsock2.h>
 #pragma comment(lib, "ws2_32.lib")
 #define strcasecmp stricmp
-typedef __int64 INT64;
 #else
 #define __USE_XOPEN
 #include <unistd.h>
 #include <netinet/in.h>
-typedef long long INT64;
+#include <sys/mman.h>
+#ifdef MADV_HUGEPAGE
+#define HUGE_PAGE (2 << 20)
 #endif
+#ifndef NO_THREADS
+#include <pthread.h>
+#define USE_THREADS
+#endif
+#endif
+#define MAX_THREADS 64
 
 #ifdef LJPEG_DECODE
 #include "jpeg.h"
@@ -45,46 +54,28 @@ typedef long long INT64;
 #include "proto.h"
 #endif
 
+#include "dcraw.h"
+
+typedef dcraw_int64 INT64;
 typedef unsigned char uchar;
 typedef unsigned short ushort;
 
-/* Global Variables */
-
-FILE *ifp;
-short order;
-char make[64], model[64], model2[64];
-int raw_height, raw_width;	/* Including black borders */
-int timestamp;
-int tiff_data_offset, tiff_data_compression;
-int kodak_data_compression;
-int nef_curve_offset;
-int height, width, colors, black, rgb_max;
-int is_canon, is_cmy, is_foveon, use_coeff, trim, ymag;
-unsigned filters;
-ushort (*image)[4];
-void (*load_raw)();
-float gamma_val=0.8, bright=1.0, red_scale=1.0, blue_scale=1.0;
-int four_color_rgb=0, use_camera_wb=0, document_mode=0, quick_interpolate=0;
-float camera_red, camera_blue;
-float pre_mul[4], coeff[3][4];
-int histogram[0x2000];
-void write_ppm(FILE *);
-void (*write_fun)(FILE *) = write_ppm;
-
-struct decode {
-  struct decode *branch[2];
-  int leaf;
-} first_decode[32], second_decode[512];
-
 /*
    In order to inline this calculation, I make the risky
    assumption that all filter patterns can be described
    by a repeating pattern of eight rows and two columns
 
    Return values are either 0/1/2/3 = G/M/C/Y or 0/1/2/3 = R/G1/B/G2
+
+   identify() unpacks the pattern into fcol[][] once per image, so
+   FC() is a table lookup instead of a variable shift.  BAYER() is
+   the one sample of a raw pixel, kept in raw_image[] until just
+   before interpolation.
  */
-#define FC(row,col) \
-	(filters >> ((((row) << 1 & 14) + ((col) & 1)) << 1) & 3)
+#define FC(row,col) dc->fcol[(row) & 7][(col) & 1]
+#define BAYER(row,col) dc->raw_image[(row)*dc->width + (col)]
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
 /*
    PowerShot 600 uses 0xe1e4e1e4:
 
@@ -144,14 +135,198 @@ struct decode {
 
  */
 
-void merror (void *ptr, char *where)
+static void merror (void *ptr, char *where)
 {
   if (ptr) return;
   fprintf (stderr, "Out of memory in %s\n", where);
   exit(1);
 }
 
-void ps600_load_raw()
+static uchar *open_view (struct dcraw_view *vp, FILE *fp, int offset, int len)
+{
+#ifndef WIN32
+  int skew = offset % sysconf(_SC_PAGESIZE);
+
+  vp->size = len + skew;
+  vp->base = mmap (0, vp->size, PROT_READ, MAP_SHARED,
+			fileno(fp), offset - skew);
+  if (vp->base != MAP_FAILED)
+    return vp->data = (uchar *) vp->base + skew;
+#endif
+  vp->base = 0;
+  vp->data = calloc (len, 1);
+  merror (vp->data, "open_view()");
+  fseek (fp, offset, SEEK_SET);
+  fread (vp->data, 1, len, fp);
+  return vp->data;
+}
+
+static void close_view (struct dcraw_view *vp)
+{
+#ifndef WIN32
+  if (vp->base) {
+    munmap (vp->base, vp->size);
+    return;
+  }
+#endif
+  free (vp->data);
+}
+
+/*
+   Return at least size bytes from this block.  The memory from the
+   last image is used again if it is big enough, and is not cleared;
+   if keep is set, what it held is kept when it has to grow.  With
+   huge_pages, big blocks are aligned and marked for transparent huge
+   pages, which cuts the page faults of filling them by 512 times.
+ */
+static void *get_block (struct dcraw *dc, struct dcraw_block *bp, size_t size,
+	int keep)
+{
+  void *mem=0;
+
+  if (size <= bp->size) return bp->mem;
+#ifdef HUGE_PAGE
+  if (dc->huge_pages && size >= HUGE_PAGE) {
+    size = (size + HUGE_PAGE-1) & -HUGE_PAGE;
+    if (!posix_memalign (&mem, HUGE_PAGE, size))
+      madvise (mem, size, MADV_HUGEPAGE);
+  } else
+#endif
+  mem = malloc (size);
+  merror (mem, "get_block()");
+  if (keep && bp->mem) memcpy (mem, bp->mem, bp->size);
+  free (bp->mem);
+  bp->mem = mem;
+  bp->size = size;
+  return mem;
+}
+
+static void free_block (struct dcraw_block *bp)
+{
+  free (bp->mem);
+  bp->mem = 0;
+  bp->size = 0;
+}
+
+/*
+   Return how many threads to work on one image with.
+ */
+static int nworkers (struct dcraw *dc)
+{
+  int n = dc->nthreads;
+
+#ifdef USE_THREADS
+  if (n < 1) n = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+  if (dc->band_threads && n > dc->band_threads) n = dc->band_threads;
+  if (n > MAX_THREADS) n = MAX_THREADS;
+  return n < 1 ? 1 : n;
+}
+
+/*
+   Return how many bands run_bands() will split this many rows into:
+   one per thread, but none smaller than 16 rows.
+ */
+static int nbands (struct dcraw *dc, int rows)
+{
+  int n = nworkers (dc);
+
+  if (n > rows / 16) n = rows / 16;
+  return n < 1 ? 1 : n;
+}
+
+/*
+   Return the size of the cache that each thread's working set
+   should fit in.
+ */
+static int cache_size()
+{
+  long size=0;
+
+#ifdef _SC_LEVEL2_CACHE_SIZE
+  size = sysconf (_SC_LEVEL2_CACHE_SIZE);
+#endif
+  return size > 0 ? size : 256 << 10;
+}
+
+struct band {
+  void (*work)(struct dcraw *dc, void *arg, int band, int top, int bottom);
+  struct dcraw *dc;
+  void *arg;
+  int band, top, bottom;
+};
+
+static void *run_band (void *arg)
+{
+  struct band *bp = arg;
+
+  (*bp->work) (bp->dc, bp->arg, bp->band, bp->top, bp->bottom);
+  return 0;
+}
+
+/*
+   Split rows top through bottom-1 into n bands and call work() once
+   for each, all at the same time if threads are available.  Returns
+   when every band is done, at once if the decode has been cancelled.
+ */
+static void run_split (struct dcraw *dc,
+	void (*work)(struct dcraw *, void *arg, int band, int top, int bottom),
+	void *arg, int top, int bottom, int n)
+{
+  struct band band[MAX_THREADS];
+  int i;
+#ifdef USE_THREADS
+  pthread_t tid[MAX_THREADS];
+  char started[MAX_THREADS];
+#endif
+
+  if (dc->cancelled) return;
+  for (i=0; i < n; i++) {
+    band[i].work = work;
+    band[i].dc = dc;
+    band[i].arg = arg;
+    band[i].band = i;
+    band[i].top = top + (bottom - top) * i / n;
+    band[i].bottom = top + (bottom - top) * (i+1) / n;
+  }
+#ifdef USE_THREADS
+  for (i=1; i < n; i++)
+    if (!(started[i] = !pthread_create (tid+i, 0, run_band, band+i)))
+      run_band (band+i);
+  run_band (band);
+  for (i=1; i < n; i++)
+    if (started[i]) pthread_join (tid[i], 0);
+#else
+  for (i=0; i < n; i++)
+    run_band (band+i);
+#endif
+}
+
+/*
+   The same, split into nbands() bands.
+ */
+static void run_bands (struct dcraw *dc,
+	void (*work)(struct dcraw *, void *arg, int band, int top, int bottom),
+	void *arg, int top, int bottom)
+{
+  run_split (dc, work, arg, top, bottom, nbands (dc, bottom - top));
+}
+
+/*
+   Tell the progress callback how far this stage has got.  Returns
+   nonzero if the decode has been cancelled, by the callback or by
+   dcraw_cancel().
+ */
+static int progress (struct dcraw *dc, enum dcraw_stage stage, int done,
+	int total)
+{
+  if (dc->progress && !dc->cancelled &&
+	(*dc->progress)(dc->progress_arg, stage, done, total))
+    dc->cancelled = 1;
+  return dc->cancelled;
+}
+
+static void ps600_load_raw(struct dcraw *dc)
 {
   uchar  data[1120], *dp;
   ushort pixel[896], *pix;
@@ -162,9 +337,9 @@ void ps600_load_raw()
    the even rows 0..612, then the odd rows 1..611.  Each row is 896
    pixels, ten bits per pixel, packed into 1120 bytes (8960 bits).
  */
-  for (irow=orow=0; irow < height; irow++)
+  for (irow=orow=0; irow < dc->height; irow++)
   {
-    fread (data, 1120, 1, ifp);
+    fread (data, 1120, 1, dc->ifp);
     for (dp=data, pix=pixel; dp < data+1120; dp+=10, pix+=8)
     {
       pix[0] = (dp[0] << 2) + (dp[1] >> 6    );
@@ -181,18 +356,18 @@ void ps600_load_raw()
    are black.  Left-shift by 4 for extra precision in upcoming
    calculations.
  */
-    for (col=0; col < width; col++)
-      image[orow*width+col][FC(orow,col)] = pixel[col] << 4;
-    for (col=width; col < 896; col++)
-      black += pixel[col];
+    for (col=0; col < dc->width; col++)
+      BAYER(orow,col) = pixel[col] << 4;
+    for (col=dc->width; col < 896; col++)
+      dc->black += pixel[col];
 
-    if ((orow+=2) > height)	/* Once we've read all the even rows, */
+    if ((orow+=2) > dc->height)	/* Once we've read all the even rows, */
       orow = 1;			/* read the odd rows. */
   }
-  black = ((INT64) black << 4) / ((896 - width) * height);
+  dc->black = ((INT64) dc->black << 4) / ((896 - dc->width) * dc->height);
 }
 
-void a5_load_raw()
+static void a5_load_raw(struct dcraw *dc)
 {
   uchar  data[1240], *dp;
   ushort pixel[992], *pix;
@@ -201,8 +376,8 @@ void a5_load_raw()
 /*
    Each data row is 992 ten-bit pixels, packed into 1240 bytes.
  */
-  for (row=0; row < height; row++) {
-    fread (data, 1240, 1, ifp);
+  for (row=0; row < dc->height; row++) {
+    fread (data, 1240, 1, dc->ifp);
     for (dp=data, pix=pixel; dp < data+1240; dp+=10, pix+=8)
     {
       pix[0] = (dp[1] << 2) + (dp[0] >> 6);
@@ -219,15 +394,15 @@ void a5_load_raw()
    are black.  Left-shift by 4 for extra precision in upcoming
    calculations.
  */
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = (pixel[col] & 0x3ff) << 4;
-    for (col=width; col < 992; col++)
-      black += pixel[col] & 0x3ff;
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = (pixel[col] & 0x3ff) << 4;
+    for (col=dc->width; col < 992; col++)
+      dc->black += pixel[col] & 0x3ff;
   }
-  black = ((INT64) black << 4) / ((992 - width) * height);
+  dc->black = ((INT64) dc->black << 4) / ((992 - dc->width) * dc->height);
 }
 
-void a50_load_raw()
+static void a50_load_raw(struct dcraw *dc)
 {
   uchar  data[1650], *dp;
   ushort pixel[1320], *pix;
@@ -236,8 +411,8 @@ void a50_load_raw()
 /*
   Each row is 1320 ten-bit pixels, packed into 1650 bytes.
  */
-  for (row=0; row < height; row++) {
-    fread (data, 1650, 1, ifp);
+  for (row=0; row < dc->height; row++) {
+    fread (data, 1650, 1, dc->ifp);
     for (dp=data, pix=pixel; dp < data+1650; dp+=10, pix+=8)
     {
       pix[0] = (dp[1] << 2) + (dp[0] >> 6);
@@ -254,15 +429,15 @@ void a50_load_raw()
    are black.  Left-shift by 4 for extra precision in upcoming
    calculations.
  */
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = (pixel[col] & 0x3ff) << 4;
-    for (col=width; col < 1320; col++)
-      black += pixel[col] & 0x3ff;
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = (pixel[col] & 0x3ff) << 4;
+    for (col=dc->width; col < 1320; col++)
+      dc->black += pixel[col] & 0x3ff;
   }
-  black = ((INT64) black << 4) / ((1320 - width) * height);
+  dc->black = ((INT64) dc->black << 4) / ((1320 - dc->width) * dc->height);
 }
 
-void pro70_load_raw()
+static void pro70_load_raw(struct dcraw *dc)
 {
   uchar  data[1940], *dp;
   ushort pixel[1552], *pix;
@@ -271,8 +446,8 @@ void pro70_load_raw()
 /*
   Each row is 1552 ten-bit pixels, packed into 1940 bytes.
  */
-  for (row=0; row < height; row++) {
-    fread (data, 1940, 1, ifp);
+  for (row=0; row < dc->height; row++) {
+    fread (data, 1940, 1, dc->ifp);
     for (dp=data, pix=pixel; dp < data+1940; dp+=10, pix+=8)
     {
       pix[0] = (dp[1] << 2) + (dp[0] >> 6);	/* Same as PS A5 */
@@ -288,8 +463,8 @@ void pro70_load_raw()
    Copy all pixels into the image[] array.  Left-shift by 4 for
    extra precision in upcoming calculations.  No black pixels?
  */
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = (pixel[col] & 0x3ff) << 4;
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = (pixel[col] & 0x3ff) << 4;
   }
 }
 
@@ -339,33 +514,32 @@ void pro70_load_raw()
 	1111110		0x0b
 	1111111		0xff
  */
-void make_decoder(struct decode *dest, const uchar *source, int level)
+static void make_decoder(struct dcraw *dc, struct dcraw_decode *dest,
+	const uchar *source, int level)
 {
-  static struct decode *free;	/* Next unused node */
-  static int leaf;		/* number of leaves already added */
   int i, next;
 
   if (level==0) {
-    free = dest;
-    leaf = 0;
+    dc->free_decode = dest;
+    dc->leaf = 0;
   }
-  free++;
+  dc->free_decode++;
 /*
    At what level should the next leaf appear?
  */
-  for (i=next=0; i <= leaf && next < 16; )
+  for (i=next=0; i <= dc->leaf && next < 16; )
     i += source[next++];
 
   if (level < next) {		/* Are we there yet? */
-    dest->branch[0] = free;
-    make_decoder(free,source,level+1);
-    dest->branch[1] = free;
-    make_decoder(free,source,level+1);
+    dest->branch[0] = dc->free_decode;
+    make_decoder(dc, dc->free_decode,source,level+1);
+    dest->branch[1] = dc->free_decode;
+    make_decoder(dc, dc->free_decode,source,level+1);
   } else
-    dest->leaf = source[16 + leaf++];
+    dest->leaf = source[16 + dc->leaf++];
 }
 
-void init_tables(unsigned table)
+static void init_tables(struct dcraw *dc, unsigned table)
 {
   static const uchar first_tree[3][29] = {
     { 0,1,4,2,3,1,2,0,0,0,0,0,0,0,0,0,
@@ -429,35 +603,34 @@ void init_tables(unsigned table)
   };
 
   if (table > 2) table = 2;
-  memset( first_decode, 0, sizeof first_decode);
-  memset(second_decode, 0, sizeof second_decode);
-  make_decoder( first_decode,  first_tree[table], 0);
-  make_decoder(second_decode, second_tree[table], 0);
+  memset( dc->first_decode, 0, sizeof dc->first_decode);
+  memset(dc->second_decode, 0, sizeof dc->second_decode);
+  make_decoder(dc,  dc->first_decode,  first_tree[table], 0);
+  make_decoder(dc, dc->second_decode, second_tree[table], 0);
 }
 
 /*
    getbits(-1) initializes the buffer
    getbits(n) where 0 <= n <= 25 returns an n-bit integer
  */
-unsigned long getbits(int nbits)
+static unsigned long getbits(struct dcraw *dc, int nbits)
 {
-  static unsigned long bitbuf=0, ret=0;
-  static int vbits=0;
+  unsigned long ret=0;
   unsigned char c;
 
   if (nbits == 0) return 0;
   if (nbits == -1)
-    ret = bitbuf = vbits = 0;
+    dc->bitbuf = dc->vbits = 0;
   else {
-    ret = bitbuf << (32 - vbits) >> (32 - nbits);
-    vbits -= nbits;
+    ret = dc->bitbuf << (32 - dc->vbits) >> (32 - nbits);
+    dc->vbits -= nbits;
   }
-  while (vbits < 25) {
-    c = fgetc(ifp);
-    bitbuf = (bitbuf << 8) + c;
-    if (c == 0xff && is_canon)	/* Canon puts an extra 0 after 0xff */
-      fgetc(ifp);
-    vbits += 8;
+  while (dc->vbits < 25) {
+    c = fgetc(dc->ifp);
+    dc->bitbuf = (dc->bitbuf << 8) + c;
+    if (c == 0xff && dc->is_canon)	/* Canon puts an extra 0 after 0xff */
+      fgetc(dc->ifp);
+    dc->vbits += 8;
   }
   return ret;
 }
@@ -466,50 +639,49 @@ unsigned long getbits(int nbits)
    Decompress "count" blocks of 64 samples each.
 
    Note that the width passed to this function is slightly
-   larger than the global width, because it includes some
+   larger than dc->width, because it includes some
    blank pixels that (*load_raw) will strip off.
  */
-void decompress(ushort *outbuf, int count)
+static void decompress(struct dcraw *dc, ushort *outbuf, int count)
 {
-  struct decode *decode, *dindex;
+  struct dcraw_decode *decode, *dindex;
   int i, leaf, len, sign, diff, diffbuf[64];
-  static int carry, pixel, base[2];
 
   if (!outbuf) {			/* Initialize */
-    carry = pixel = 0;
-    fseek (ifp, count, SEEK_SET);
-    getbits(-1);
+    dc->carry = dc->pixel = 0;
+    fseek (dc->ifp, count, SEEK_SET);
+    getbits(dc, -1);
     return;
   }
   while (count--) {
     memset(diffbuf,0,sizeof diffbuf);
-    decode = first_decode;
+    decode = dc->first_decode;
     for (i=0; i < 64; i++ ) {
 
       for (dindex=decode; dindex->branch[0]; )
-	dindex = dindex->branch[getbits(1)];
+	dindex = dindex->branch[getbits(dc, 1)];
       leaf = dindex->leaf;
-      decode = second_decode;
+      decode = dc->second_decode;
 
       if (leaf == 0 && i) break;
       if (leaf == 0xff) continue;
       i  += leaf >> 4;
       len = leaf & 15;
       if (len == 0) continue;
-      sign=(getbits(1));	/* 1 is positive, 0 is negative */
-      diff=getbits(len-1);
+      sign=(getbits(dc, 1));	/* 1 is positive, 0 is negative */
+      diff=getbits(dc, len-1);
       if (sign)
 	diff += 1 << (len-1);
       else
 	diff += (-1 << len) + 1;
       if (i < 64) diffbuf[i] = diff;
     }
-    diffbuf[0] += carry;
-    carry = diffbuf[0];
+    diffbuf[0] += dc->carry;
+    dc->carry = diffbuf[0];
     for (i=0; i < 64; i++ ) {
-      if (pixel++ % raw_width == 0)
-	base[0] = base[1] = 512;
-      outbuf[i] = ( base[i & 1] += diffbuf[i] );
+      if (dc->pixel++ % dc->raw_width == 0)
+	dc->base[0] = dc->base[1] = 512;
+      outbuf[i] = ( dc->base[i & 1] += diffbuf[i] );
     }
     outbuf += 64;
   }
@@ -521,13 +693,13 @@ void decompress(ushort *outbuf, int count)
 
    In Canon compressed data, 0xff is always followed by 0x00.
  */
-int canon_has_lowbits()
+static int canon_has_lowbits(struct dcraw *dc)
 {
   uchar test[8192];
   int ret=1, i;
 
-  fseek (ifp, 0, SEEK_SET);
-  fread (test, 1, 8192, ifp);
+  fseek (dc->ifp, 0, SEEK_SET);
+  fread (test, 1, 8192, dc->ifp);
   for (i=540; i < 8191; i++)
     if (test[i] == 0xff) {
       if (test[i+1]) return 1;
@@ -536,7 +708,7 @@ int canon_has_lowbits()
   return ret;
 }
 
-void canon_compressed_load_raw()
+static void canon_compressed_load_raw(struct dcraw *dc)
 {
   ushort *pixel, *prow;
   int lowbits, shift, i, row, r, col, save;
@@ -544,53 +716,64 @@ void canon_compressed_load_raw()
   uchar c;
 
 /* Set the width of the black borders */
-  switch (raw_width) {
+  switch (dc->raw_width) {
     case 2144:  top = 8;  left =  4;  break;	/* G1 */
     case 2224:  top = 6;  left = 48;  break;	/* EOS D30 */
     case 2376:  top = 6;  left = 12;  break;	/* G2 or G3 */
     case 2672:  top = 6;  left = 12;  break;	/* S50 */
     case 3152:  top =12;  left = 64;  break;	/* EOS D60 */
   }
-  pixel = calloc (raw_width*8, sizeof *pixel);
+  pixel = calloc (dc->raw_width*8, sizeof *pixel);
   merror (pixel, "canon_compressed_load_raw()");
-  lowbits = canon_has_lowbits();
+  lowbits = canon_has_lowbits(dc);
   shift = 4 - lowbits*2;
-  decompress(0, 540 + lowbits*raw_height*raw_width/4);
-  for (row = 0; row < raw_height; row += 8) {
-    decompress(pixel, raw_width/8);		/* Get eight rows */
+  decompress(dc, 0, 540 + lowbits*dc->raw_height*dc->raw_width/4);
+  for (row = 0; row < dc->raw_height; row += 8) {
+    decompress(dc, pixel, dc->raw_width/8);		/* Get eight rows */
     if (lowbits) {
-      save = ftell(ifp);			/* Don't lose our place */
-      fseek (ifp, 26 + row*raw_width/4, SEEK_SET);
-      for (prow=pixel, i=0; i < raw_width*2; i++) {
-	c = fgetc(ifp);
+      save = ftell(dc->ifp);			/* Don't lose our place */
+      fseek (dc->ifp, 26 + row*dc->raw_width/4, SEEK_SET);
+      for (prow=pixel, i=0; i < dc->raw_width*2; i++) {
+	c = fgetc(dc->ifp);
 	for (r = 0; r < 8; r += 2)
 	  *prow++ = (*prow << 2) + ((c >> r) & 3);
       }
-      fseek (ifp, save, SEEK_SET);
+      fseek (dc->ifp, save, SEEK_SET);
     }
     for (r=0; r < 8; r++)
-      for (col = 0; col < raw_width; col++) {
+      for (col = 0; col < dc->raw_width; col++) {
 	irow = row+r-top;
 	icol = col-left;
-	if (irow >= height) continue;
-	if (icol < width)
-	  image[irow*width+icol][FC(irow,icol)] =
-		pixel[r*raw_width+col] << shift;
+	if (irow >= dc->height) continue;
+	if (icol < dc->width)
+	  BAYER(irow,icol) =
+		pixel[r*dc->raw_width+col] << shift;
 	  else
-	    black += pixel[r*raw_width+col];
+	    dc->black += pixel[r*dc->raw_width+col];
       }
   }
   free(pixel);
-  black = ((INT64) black << shift) / ((raw_width - width) * height);
+  dc->black = ((INT64) dc->black << shift) /
+	((dc->raw_width - dc->width) * dc->height);
 }
 
 #ifdef LJPEG_DECODE
+/*
+   The lossless JPEG decoder keeps its own state in globals and calls
+   back without any of ours, so it decodes one image at a time, and
+   finds that image here.
+ */
+static struct dcraw *jpeg_dc;
+#ifdef USE_THREADS
+static pthread_mutex_t jpeg_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 /*
    Lossless JPEG code calls this function to get data.
  */
 int ReadJpegData (char *buffer, int numBytes)
 {
-  return fread(buffer, 1, numBytes, ifp);
+  return fread(buffer, 1, numBytes, jpeg_dc->ifp);
 }
 
 /*
@@ -603,23 +786,28 @@ int ReadJpegData (char *buffer, int numBytes)
  */
 void PmPutRow(ushort **buf, int numComp, int numCol, int row)
 {
+  struct dcraw *dc = jpeg_dc;
   int r, col, trick=1;
 
-  trick = numComp * numCol / width;
+  trick = numComp * numCol / dc->width;
   row *= trick;
   for (r = row; r < row+trick; r++)
-    for (col = 0; col < width; col+=2) {
-      image[r*width+col+0][FC(r,col+0)] = buf[0][0] << 2;
-      image[r*width+col+1][FC(r,col+1)] = buf[0][1] << 2;
+    for (col = 0; col < dc->width; col+=2) {
+      BAYER(r,col+0) = buf[0][0] << 2;
+      BAYER(r,col+1) = buf[0][1] << 2;
       buf++;
     }
 }
 
-void lossless_jpeg_load_raw()
+static void lossless_jpeg_load_raw(struct dcraw *dc)
 {
   DecompressInfo dcInfo;
 
-  fseek (ifp, tiff_data_offset, SEEK_SET);
+#ifdef USE_THREADS
+  pthread_mutex_lock (&jpeg_lock);
+#endif
+  jpeg_dc = dc;
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
 
   MEMSET(&dcInfo, 0, sizeof(dcInfo));
   ReadFileHeader (&dcInfo);
@@ -629,15 +817,18 @@ void lossless_jpeg_load_raw()
   DecodeImage (&dcInfo);
   FreeArray2D (mcuROW1);
   FreeArray2D (mcuROW2);
+#ifdef USE_THREADS
+  pthread_mutex_unlock (&jpeg_lock);
+#endif
 }
 #else
-void lossless_jpeg_load_raw() { }
+static void lossless_jpeg_load_raw(struct dcraw *dc) { }
 #endif /* LJPEG_DECODE */
 
-ushort fget2 (FILE *f);
-int    fget4 (FILE *f);
+static ushort fget2 (struct dcraw *dc, FILE *f);
+static int    fget4 (struct dcraw *dc, FILE *f);
 
-void nikon_compressed_load_raw()
+static void nikon_compressed_load_raw(struct dcraw *dc)
 {
   int left=0, right=0;
   static const uchar nikon_tree[] = {
@@ -646,37 +837,37 @@ void nikon_compressed_load_raw()
   };
   int vpred[4], hpred[2], csize, row, col, i, len, diff;
   ushort *curve;
-  struct decode *dindex;
+  struct dcraw_decode *dindex;
 
-  if (!strcmp(model,"D1X"))
+  if (!strcmp(dc->model,"D1X"))
     right = 4;
-  if (!strcmp(model,"D2H")) {
+  if (!strcmp(dc->model,"D2H")) {
     left  = 6;
     right = 8;
   }
 
-  memset( first_decode, 0, sizeof first_decode);
-  make_decoder( first_decode,  nikon_tree, 0);
+  memset( dc->first_decode, 0, sizeof dc->first_decode);
+  make_decoder(dc, dc->first_decode, nikon_tree, 0);
 
-  fseek (ifp, nef_curve_offset, SEEK_SET);
+  fseek (dc->ifp, dc->nef_curve_offset, SEEK_SET);
   for (i=0; i < 4; i++)
-    vpred[i] = fget2(ifp);
-  csize = fget2(ifp);
+    vpred[i] = fget2(dc, dc->ifp);
+  csize = fget2(dc, dc->ifp);
   curve = calloc (csize, sizeof *curve);
   merror (curve, "nikon_compressed_load_raw()");
   for (i=0; i < csize; i++)
-    curve[i] = fget2(ifp);
+    curve[i] = fget2(dc, dc->ifp);
 
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  getbits(-1);
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  getbits(dc, -1);
 
-  for (row=0; row < height; row++)
-    for (col=-left; col < width+right; col++)
+  for (row=0; row < dc->height; row++)
+    for (col=-left; col < dc->width+right; col++)
     {
-      for (dindex=first_decode; dindex->branch[0]; )
-	dindex = dindex->branch[getbits(1)];
+      for (dindex=dc->first_decode; dindex->branch[0]; )
+	dindex = dindex->branch[getbits(dc, 1)];
       len = dindex->leaf;
-      diff = getbits(len);
+      diff = getbits(dc, len);
       if ((diff & (1 << (len-1))) == 0)
 	diff -= (1 << len) - 1;
       if (col+left < 2) {
@@ -685,11 +876,11 @@ void nikon_compressed_load_raw()
 	hpred[col & 1] = vpred[i];
       } else
 	hpred[col & 1] += diff;
-      if ((unsigned) col >= width) continue;
+      if ((unsigned) col >= dc->width) continue;
       diff = hpred[col & 1];
       if (diff < 0) diff = 0;
       if (diff >= csize) diff = csize-1;
-      image[row*width+col][FC(row,col)] = curve[diff] << 2;
+      BAYER(row,col) = curve[diff] << 2;
     }
   free(curve);
 }
@@ -699,115 +890,115 @@ void nikon_compressed_load_raw()
    are only needed for the D100, thanks to a bug in some cameras
    that tags all images as "compressed".
  */
-int nikon_is_compressed()
+static int nikon_is_compressed(struct dcraw *dc)
 {
   uchar test[256];
   int i;
 
-  if (tiff_data_compression != 34713)
+  if (dc->tiff_data_compression != 34713)
     return 0;
-  if (strcmp(model,"D100"))
+  if (strcmp(dc->model,"D100"))
     return 1;
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  fread (test, 1, 256, ifp);
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  fread (test, 1, 256, dc->ifp);
   for (i=15; i < 256; i+=16)
     if (test[i]) return 1;
   return 0;
 }
 
-void nikon_load_raw()
+static void nikon_load_raw(struct dcraw *dc)
 {
   int left=0, right=0, skip16=0;
   int irow, row, col, i;
 
-  if (!strcmp(model,"D100"))
-    width = 3034;
-  if (nikon_is_compressed()) {
-    nikon_compressed_load_raw();
+  if (!strcmp(dc->model,"D100"))
+    dc->width = 3034;
+  if (nikon_is_compressed(dc)) {
+    nikon_compressed_load_raw(dc);
     return;
   }
-  if (!strcmp(model,"D1X"))
+  if (!strcmp(dc->model,"D1X"))
     right = 4;
-  if (!strcmp(model,"D100") && tiff_data_compression == 34713) {
+  if (!strcmp(dc->model,"D100") && dc->tiff_data_compression == 34713) {
     right = 3;
     skip16 = 1;
-    width = 3037;
+    dc->width = 3037;
   }
-  if (!strcmp(model,"D2H")) {
+  if (!strcmp(dc->model,"D2H")) {
     left  = 6;
     right = 8;
   }
 
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  getbits(-1);
-  for (irow=0; irow < height; irow++) {
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  getbits(dc, -1);
+  for (irow=0; irow < dc->height; irow++) {
     row = irow;
-    if (model[0] == 'E') {
-      row = irow * 2 % height + irow / (height/2);
-      if (row == 1 && atoi(model+1) < 5000) {
-	fseek (ifp, 0, SEEK_END);
-	fseek (ifp, ftell(ifp)/2, SEEK_SET);
-	getbits(-1);
+    if (dc->model[0] == 'E') {
+      row = irow * 2 % dc->height + irow / (dc->height/2);
+      if (row == 1 && atoi(dc->model+1) < 5000) {
+	fseek (dc->ifp, 0, SEEK_END);
+	fseek (dc->ifp, ftell(dc->ifp)/2, SEEK_SET);
+	getbits(dc, -1);
       }
     }
-    for (col=-left; col < width+right; col++) {
-      i = getbits(12);
-      if ((unsigned) col < width)
-	image[row*width+col][FC(row,col)] = i << 2;
+    for (col=-left; col < dc->width+right; col++) {
+      i = getbits(dc, 12);
+      if ((unsigned) col < dc->width)
+	BAYER(row,col) = i << 2;
       if (skip16 && (col % 10) == 9)
-	getbits(8);
+	getbits(dc, 8);
     }
   }
 }
 
-void nikon_e950_load_raw()
+static void nikon_e950_load_raw(struct dcraw *dc)
 {
   int irow, row, col;
 
-  fseek (ifp, 0, SEEK_SET);
-  getbits(-1);
-  for (irow=0; irow < height; irow++) {
-    row = irow * 2 % height;
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = getbits(10) << 4;
+  fseek (dc->ifp, 0, SEEK_SET);
+  getbits(dc, -1);
+  for (irow=0; irow < dc->height; irow++) {
+    row = irow * 2 % dc->height;
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = getbits(dc, 10) << 4;
     for (col=28; col--; )
-      getbits(8);
+      getbits(dc, 8);
   }
 }
 
 /*
    The Fuji Super CCD is just a Bayer grid rotated 45 degrees.
  */
-void fuji_s2_load_raw()
+static void fuji_s2_load_raw(struct dcraw *dc)
 {
   ushort pixel[2944];
   int row, col, r, c;
 
-  fseek (ifp, tiff_data_offset + (2944*24+32)*2, SEEK_SET);
+  fseek (dc->ifp, dc->tiff_data_offset + (2944*24+32)*2, SEEK_SET);
   for (row=0; row < 2144; row++) {
-    fread (pixel, 2, 2944, ifp);
+    fread (pixel, 2, 2944, dc->ifp);
     for (col=0; col < 2880; col++) {
       r = row + ((col+1) >> 1);
       c = 2143 - row + (col >> 1);
-      image[r*width+c][FC(r,c)] = ntohs(pixel[col]) << 2;
+      BAYER(r,c) = ntohs(pixel[col]) << 2;
     }
   }
 }
 
-void fuji_s5000_load_raw()
+static void fuji_s5000_load_raw(struct dcraw *dc)
 {
   ushort pixel[1472];
   int row, col, r, c;
 
-  fseek (ifp, tiff_data_offset + (1472*4+24)*2, SEEK_SET);
+  fseek (dc->ifp, dc->tiff_data_offset + (1472*4+24)*2, SEEK_SET);
   for (row=0; row < 2152; row++) {
-    fread (pixel, 2, 1472, ifp);
+    fread (pixel, 2, 1472, dc->ifp);
     if (ntohs(0xaa55) == 0xaa55)	/* data is little-endian */
       swab (pixel, pixel, 1472*2);
     for (col=0; col < 1424; col++) {
       r = 1423 - col + (row >> 1);
       c = col + ((row+1) >> 1);
-      image[r*width+c][FC(r,c)] = pixel[col];
+      BAYER(r,c) = pixel[col];
     }
   }
 }
@@ -817,14 +1008,14 @@ void fuji_s5000_load_raw()
    The secondary has about 1/16 the sensitivity of the primary,
    but this ratio may vary.
  */
-void fuji_f700_load_raw()
+static void fuji_f700_load_raw(struct dcraw *dc)
 {
   ushort pixel[2944];
   int row, col, r, c, val;
 
-  fseek (ifp, tiff_data_offset, SEEK_SET);
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
   for (row=0; row < 2168; row++) {
-    fread (pixel, 2, 2944, ifp);
+    fread (pixel, 2, 2944, dc->ifp);
     if (ntohs(0xaa55) == 0xaa55)	/* data is little-endian */
       swab (pixel, pixel, 2944*2);
     for (col=0; col < 1440; col++) {
@@ -835,23 +1026,23 @@ void fuji_f700_load_raw()
 	val = pixel[col+1488] << 4;	/* use the secondary.       */
       if (val > 0xffff)
 	val = 0xffff;
-      image[r*width+c][FC(r,c)] = val;
+      BAYER(r,c) = val;
     }
   }
 }
 
-void rollei_load_raw()
+static void rollei_load_raw(struct dcraw *dc)
 {
   uchar pixel[10];
   unsigned left=0, top=0, iten=0, isix, i, buffer=0, row, col, todo[16];
 
-  switch (raw_width) {
-    case 1316: left = 6; top = 1; width = 1300; height = 1030;  break;
-    case 2568: left = 8; top = 2; width = 2560; height = 1960;  break;
+  switch (dc->raw_width) {
+    case 1316: left = 6; top = 1; dc->width = 1300; dc->height = 1030;  break;
+    case 2568: left = 8; top = 2; dc->width = 2560; dc->height = 1960;  break;
   }
-  isix = raw_width * raw_height * 5 / 8;
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  while (fread (pixel, 1, 10, ifp) == 10) {
+  isix = dc->raw_width * dc->raw_height * 5 / 8;
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  while (fread (pixel, 1, 10, dc->ifp) == 10) {
     for (i=0; i < 10; i+=2) {
       todo[i]   = iten++;
       todo[i+1] = pixel[i] << 8 | pixel[i+1];
@@ -862,192 +1053,193 @@ void rollei_load_raw()
       todo[i+1] = buffer >> (14-i)*5;
     }
     for (i=0; i < 16; i+=2) {
-      row = todo[i] / raw_width - top;
-      col = todo[i] % raw_width - left;
-      if (row < height && col < width)
-	image[row*width+col][FC(row,col)] = (todo[i+1] & 0x3ff) << 4;
+      row = todo[i] / dc->raw_width - top;
+      col = todo[i] % dc->raw_width - left;
+      if (row < dc->height && col < dc->width)
+	BAYER(row,col) = (todo[i+1] & 0x3ff) << 4;
     }
   }
 }
 
-void packed_12_load_raw()
+static void packed_12_load_raw(struct dcraw *dc)
 {
   int row, col;
 
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  getbits(-1);
-  for (row=0; row < height; row++)
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = getbits(12) << 2;
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  getbits(dc, -1);
+  for (row=0; row < dc->height; row++)
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = getbits(dc, 12) << 2;
 }
 
-void unpacked_12_load_raw()
+static void unpacked_12_load_raw(struct dcraw *dc)
 {
   ushort *pixel;
   int row, col;
 
-  pixel = calloc (width, sizeof *pixel);
+  pixel = calloc (dc->width, sizeof *pixel);
   merror (pixel, "unpacked_12_load_raw()");
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  for (row=0; row < height; row++) {
-    fread (pixel, 2, width, ifp);
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = ntohs(pixel[col]) << 2;
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  for (row=0; row < dc->height; row++) {
+    fread (pixel, 2, dc->width, dc->ifp);
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = ntohs(pixel[col]) << 2;
   }
   free(pixel);
 }
 
-void olympus_load_raw()
+static void olympus_load_raw(struct dcraw *dc)
 {
   ushort *pixel;
   int row, col;
 
-  pixel = calloc (width, sizeof *pixel);
+  pixel = calloc (dc->width, sizeof *pixel);
   merror (pixel, "olympus_load_raw()");
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  for (row=0; row < height; row++) {
-    fread (pixel, 2, width, ifp);
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = ntohs(pixel[col]) >> 2;
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  for (row=0; row < dc->height; row++) {
+    fread (pixel, 2, dc->width, dc->ifp);
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = ntohs(pixel[col]) >> 2;
   }
   free(pixel);
 }
 
-void olympus2_load_raw()
+static void olympus2_load_raw(struct dcraw *dc)
 {
   int irow, row, col;
 
-  for (irow=0; irow < height; irow++) {
-    row = irow * 2 % height + irow / (height/2);
+  for (irow=0; irow < dc->height; irow++) {
+    row = irow * 2 % dc->height + irow / (dc->height/2);
     if (row < 2) {
-      fseek (ifp, 15360 + row*(width*height*3/4 + 184), SEEK_SET);
-      getbits(-1);
+      fseek (dc->ifp, 15360 + row*(dc->width*dc->height*3/4 + 184), SEEK_SET);
+      getbits(dc, -1);
     }
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = getbits(12) << 2;
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = getbits(dc, 12) << 2;
   }
 }
 
-void kyocera_load_raw()
+static void kyocera_load_raw(struct dcraw *dc)
 {
   int row, col;
 
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  getbits(-1);
-  for (row=0; row < height; row++)
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = getbits(12) << 2;
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  getbits(dc, -1);
+  for (row=0; row < dc->height; row++)
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = getbits(dc, 12) << 2;
 }
 
-void casio_easy_load_raw()
+static void casio_easy_load_raw(struct dcraw *dc)
 {
   uchar *pixel;
   int row, col;
 
-  pixel = calloc (raw_width, sizeof *pixel);
+  pixel = calloc (dc->raw_width, sizeof *pixel);
   merror (pixel, "casio_easy_load_raw()");
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  for (row=0; row < height; row++) {
-    fread (pixel, 1, raw_width, ifp);
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = pixel[col] << 6;
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  for (row=0; row < dc->height; row++) {
+    fread (pixel, 1, dc->raw_width, dc->ifp);
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = pixel[col] << 6;
   }
   free (pixel);
 }
 
-void casio_qv5700_load_raw()
+static void casio_qv5700_load_raw(struct dcraw *dc)
 {
   uchar  data[3232],  *dp;
   ushort pixel[2576], *pix;
   int row, col;
 
-  fseek (ifp, 0, SEEK_SET);
-  for (row=0; row < height; row++) {
-    fread (data, 1, 3232, ifp);
+  fseek (dc->ifp, 0, SEEK_SET);
+  for (row=0; row < dc->height; row++) {
+    fread (data, 1, 3232, dc->ifp);
     for (dp=data, pix=pixel; dp < data+3220; dp+=5, pix+=4) {
       pix[0] = (dp[0] << 2) + (dp[1] >> 6);
       pix[1] = (dp[1] << 4) + (dp[2] >> 4);
       pix[2] = (dp[2] << 6) + (dp[3] >> 2);
       pix[3] = (dp[3] << 8) + (dp[4]     );
     }
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = (pixel[col] & 0x3ff) << 4;
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = (pixel[col] & 0x3ff) << 4;
   }
 }
 
-void nucore_load_raw()
+static void nucore_load_raw(struct dcraw *dc)
 {
   uchar *data, *dp;
   int irow, row, col;
 
-  data = calloc (width, 2);
+  data = calloc (dc->width, 2);
   merror (data, "nucore_load_raw()");
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  for (irow=0; irow < height; irow++) {
-    fread (data, 2, width, ifp);
-    if (model[0] == 'B' && width == 2598)
-      row = height - 1 - irow/2 - height/2 * (irow & 1);
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  for (irow=0; irow < dc->height; irow++) {
+    fread (data, 2, dc->width, dc->ifp);
+    if (dc->model[0] == 'B' && dc->width == 2598)
+      row = dc->height - 1 - irow/2 - dc->height/2 * (irow & 1);
     else
       row = irow;
-    for (dp=data, col=0; col < width; col++, dp+=2)
-      image[row*width+col][FC(row,col)] = (dp[0] << 2) + (dp[1] << 10);
+    for (dp=data, col=0; col < dc->width; col++, dp+=2)
+      BAYER(row,col) = (dp[0] << 2) + (dp[1] << 10);
   }
   free(data);
 }
 
-void kodak_easy_load_raw()
+static void kodak_easy_load_raw(struct dcraw *dc)
 {
   uchar *pixel;
   int row, col, margin;
 
-  if ((margin = (raw_width - width)/2))
-    black = 0;
-  pixel = calloc (raw_width, sizeof *pixel);
+  if ((margin = (dc->raw_width - dc->width)/2))
+    dc->black = 0;
+  pixel = calloc (dc->raw_width, sizeof *pixel);
   merror (pixel, "kodak_easy_load_raw()");
-  fseek (ifp, tiff_data_offset, SEEK_SET);
-  for (row=0; row < height; row++) {
-    fread (pixel, 1, raw_width, ifp);
-    for (col=0; col < width; col++)
-      image[row*width+col][FC(row,col)] = (ushort) pixel[col+margin] << 6;
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
+  for (row=0; row < dc->height; row++) {
+    fread (pixel, 1, dc->raw_width, dc->ifp);
+    for (col=0; col < dc->width; col++)
+      BAYER(row,col) = (ushort) pixel[col+margin] << 6;
     if (margin == 2)
-      black += pixel[0] + pixel[1] + pixel[raw_width-2] + pixel[raw_width-1];
+      dc->black += pixel[0] + pixel[1] +
+	pixel[dc->raw_width-2] + pixel[dc->raw_width-1];
   }
   if (margin)
-    black = ((INT64) black << 6) / (4 * height);
+    dc->black = ((INT64) dc->black << 6) / (4 * dc->height);
   free(pixel);
 }
 
-void kodak_compressed_load_raw()
+static void kodak_compressed_load_raw(struct dcraw *dc)
 {
   uchar c, blen[256];
   unsigned row, col, len, i, bits=0, pred[2];
   INT64 bitbuf=0;
   int diff;
 
-  fseek (ifp, tiff_data_offset, SEEK_SET);
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
 
-  for (row=0; row < height; row++)
-    for (col=0; col < width; col++)
+  for (row=0; row < dc->height; row++)
+    for (col=0; col < dc->width; col++)
     {
       if ((col & 255) == 0) {		/* Get the bit-lengths of the */
-	len = width - col;		/* next 256 pixel values      */
+	len = dc->width - col;		/* next 256 pixel values      */
 	if (len > 256) len = 256;
 	for (i=0; i < len; ) {
-	  c = fgetc(ifp);
+	  c = fgetc(dc->ifp);
 	  blen[i++] = c & 15;
 	  blen[i++] = c >> 4;
 	}
 	bitbuf = bits = pred[0] = pred[1] = 0;
 	if (len % 8 == 4) {
-	  bitbuf  = fgetc(ifp) << 8;
-	  bitbuf += fgetc(ifp);
+	  bitbuf  = fgetc(dc->ifp) << 8;
+	  bitbuf += fgetc(dc->ifp);
 	  bits = 16;
 	}
       }
       len = blen[col & 255];		/* Number of bits for this pixel */
       if (bits < len) {			/* Got enough bits in the buffer? */
 	for (i=0; i < 32; i+=8)
-	  bitbuf += (INT64) fgetc(ifp) << (bits+(i^8));
+	  bitbuf += (INT64) fgetc(dc->ifp) << (bits+(i^8));
 	bits += 32;
       }
       diff = bitbuf & (0xffff >> (16-len));  /* Pull bits from buffer */
@@ -1057,11 +1249,11 @@ void kodak_compressed_load_raw()
 	diff -= (1 << len) - 1;
       pred[col & 1] += diff;
       diff = pred[col & 1];
-      image[row*width+col][FC(row,col)] = diff << 2;
+      BAYER(row,col) = diff << 2;
     }
 }
 
-void kodak_yuv_load_raw()
+static void kodak_yuv_load_raw(struct dcraw *dc)
 {
   uchar c, blen[384];
   unsigned row, col, len, bits=0;
@@ -1069,15 +1261,15 @@ void kodak_yuv_load_raw()
   int i, li=0, si, diff, six[6], y[4], cb=0, cr=0, rgb[3];
   ushort *ip;
 
-  fseek (ifp, tiff_data_offset, SEEK_SET);
+  fseek (dc->ifp, dc->tiff_data_offset, SEEK_SET);
 
-  for (row=0; row < height; row+=2)
-    for (col=0; col < width; col+=2) {
+  for (row=0; row < dc->height; row+=2)
+    for (col=0; col < dc->width; col+=2) {
       if ((col & 127) == 0) {
-	len = (width - col) * 3;
+	len = (dc->width - col) * 3;
 	if (len > 384) len = 384;
 	for (i=0; i < len; ) {
-	  c = fgetc(ifp);
+	  c = fgetc(dc->ifp);
 	  blen[i++] = c & 15;
 	  blen[i++] = c >> 4;
 	}
@@ -1087,7 +1279,7 @@ void kodak_yuv_load_raw()
 	len = blen[li++];
 	if (bits < len) {
 	  for (i=0; i < 32; i+=8)
-	    bitbuf += (INT64) fgetc(ifp) << (bits+(i^8));
+	    bitbuf += (INT64) fgetc(dc->ifp) << (bits+(i^8));
 	  bits += 32;
 	}
 	diff = bitbuf & (0xffff >> (16-len));
@@ -1104,7 +1296,7 @@ void kodak_yuv_load_raw()
       cb  += six[4];
       cr  += six[5];
       for (i=0; i < 4; i++) {
-	ip = image[(row+(i >> 1))*width + col+(i & 1)];
+	ip = dc->image[(row+(i >> 1))*dc->width + col+(i & 1)];
 	rgb[0] = y[i] + 1.40200/2 * cr;
 	rgb[1] = y[i] - 0.34414/2 * cb - 0.71414/2 * cr;
 	rgb[2] = y[i] + 1.77200/2 * cb;
@@ -1114,12 +1306,12 @@ void kodak_yuv_load_raw()
     }
 }
 
-void foveon_decoder(struct decode *dest, unsigned huff[1024], unsigned code)
+static void foveon_decoder(struct dcraw *dc, struct dcraw_decode *dest,
+	unsigned huff[1024], unsigned code)
 {
-  static struct decode *free;
   int i, len;
 
-  free++;
+  dc->free_decode++;
   if (code) {
     for (i=0; i < 1024; i++)
       if (huff[i] == code) {
@@ -1127,65 +1319,65 @@ void foveon_decoder(struct decode *dest, unsigned huff[1024], unsigned code)
 	return;
       }
   } else
-    free = dest + 1;
+    dc->free_decode = dest + 1;
 
   if ((len = code >> 27) > 26) return;
   code = (len+1) << 27 | (code & 0x3ffffff) << 1;
 
-  dest->branch[0] = free;
-  foveon_decoder (free, huff, code);
-  dest->branch[1] = free;
-  foveon_decoder (free, huff, code+1);
+  dest->branch[0] = dc->free_decode;
+  foveon_decoder (dc, dc->free_decode, huff, code);
+  dest->branch[1] = dc->free_decode;
+  foveon_decoder (dc, dc->free_decode, huff, code+1);
 }
 
-void foveon_load_raw()
+static void foveon_load_raw(struct dcraw *dc)
 {
-  struct decode decode[2048], *dindex;
+  struct dcraw_decode decode[2048], *dindex;
   short diff[1024], pred[3];
   unsigned huff[1024], bitbuf=0, top=0, left=0;
   int row, col, bit=-1, c, i;
 
 /* Set the width of the black borders */
-  switch (raw_height) {
+  switch (dc->raw_height) {
     case  763:  top = 2;  break;
     case 1531:  top = 7;  break;
   }
-  switch (raw_width) {
+  switch (dc->raw_width) {
     case 1152: left =  8;  break;
     case 2304: left = 17;  break;
   }
-  fseek (ifp, 260, SEEK_SET);
+  fseek (dc->ifp, 260, SEEK_SET);
   for (i=0; i < 1024; i++)
-    diff[i] = fget2(ifp);
+    diff[i] = fget2(dc, dc->ifp);
   for (i=0; i < 1024; i++)
-    huff[i] = fget4(ifp);
+    huff[i] = fget4(dc, dc->ifp);
 
   memset (decode, 0, sizeof decode);
-  foveon_decoder (decode,  huff, 0);
+  foveon_decoder (dc, decode, huff, 0);
 
-  for (row=0; row < raw_height; row++) {
+  for (row=0; row < dc->raw_height; row++) {
     memset (pred, 0, sizeof pred);
-    if (!bit) fget4(ifp);
-    for (col=bit=0; col < raw_width; col++) {
+    if (!bit) fget4(dc, dc->ifp);
+    for (col=bit=0; col < dc->raw_width; col++) {
       for (c=0; c < 3; c++) {
 	for (dindex=decode; dindex->branch[0]; ) {
 	  if ((bit = (bit-1) & 31) == 31)
 	    for (i=0; i < 4; i++)
-	      bitbuf = (bitbuf << 8) + fgetc(ifp);
+	      bitbuf = (bitbuf << 8) + fgetc(dc->ifp);
 	  dindex = dindex->branch[bitbuf >> bit & 1];
 	}
 	pred[c] += diff[dindex->leaf];
       }
-      if ((unsigned) row-top  >= height ||
-	  (unsigned) col-left >= width ) continue;
+      if ((unsigned) row-top  >= dc->height ||
+	  (unsigned) col-left >= dc->width ) continue;
       for (c=0; c < 3; c++)
 	if (pred[c] > 0)
-	  image[(row-top)*width+(col-left)][c] = pred[c];
+	  dc->image[(row-top)*dc->width+(col-left)][c] = pred[c];
     }
   }
 }
 
-int apply_curve(int i, const int *curve)
+static int apply_curve(int i, const int *curve)
 {
   if (i <= -curve[0])
     return -curve[curve[0]]-1;
@@ -1197,9 +1389,46 @@ int apply_curve(int i, const int *curve)
     return  curve[curve[0]]+1;
 }
 
-void foveon_interpolate()
+struct foveon {
+  ushort (*halo)[4];		/* Rows either side of each band */
+  ushort (*shrink)[3];		/* The image smoothed at 1/4 scale */
+  ushort (*across)[3];		/* One row of that per four, full width */
+};
+
+/*
+   Save the two rows above and the two below this band, which the
+   bands next to it are about to change.
+ */
+static void foveon_save_band (struct dcraw *dc, void *arg, int band,
+	int top, int bottom)
+{
+  struct foveon *fv = arg;
+  int i, row;
+
+  for (i=0; i < 4; i++) {
+    row = i < 2 ? top-2+i : bottom-2+i;
+    if (row >= 0 && row < dc->height)
+      memcpy (fv->halo + (band*4+i) * dc->width, dc->image + row*dc->width,
+		dc->width * sizeof *dc->image);
+  }
+}
+
+/*
+   Return a pixel as it was before this band's pass began.
+ */
+static ushort *foveon_pixel (struct dcraw *dc, struct foveon *fv, int band,
+	int top, int bottom, int row, int col)
+{
+  if (row < top)
+    return fv->halo[(band*4 + row-top+2) * dc->width + col];
+  if (row >= bottom)
+    return fv->halo[(band*4 + row-bottom+2) * dc->width + col];
+  return dc->image[row*dc->width + col];
+}
+
+static void foveon_sharpen_row (struct dcraw *dc, ushort *pix)
 {
-  float mul[3] =
+  static const float mul[3] =
   { 1.0321, 1.0, 1.1124 };
   static const int weight[3][3][3] =
   { { {   4141,  37726,  11265  },
@@ -1210,85 +1439,76 @@ void foveon_interpolate()
       {  -2381,   3496,  -2008  } },
     { {  -3838, -24025, -12968  },
       {  20144, -12195,  30272  },
-      {   -631,  -2025,    822  } } },
-  curve1[73] = { 72,
-     0,1,2,2,3,4,5,6,6,7,8,9,9,10,11,11,12,13,13,14,14,
-    15,16,16,17,17,18,18,18,19,19,20,20,20,21,21,21,22,
-    22,22,23,23,23,23,23,24,24,24,24,24,25,25,25,25,25,
-    25,25,25,26,26,26,26,26,26,26,26,26,26,26,26,26,26 },
-  curve2[21] = { 20,
-    0,1,1,2,3,3,4,4,5,5,6,6,6,7,7,7,7,7,7,7 },
-  curve3[73] = { 72,
-     0,1,1,2,2,3,4,4,5,5,6,6,7,7,8,8,8,9,9,10,10,10,10,
-    11,11,11,12,12,12,12,12,12,13,13,13,13,13,13,13,13,
-    14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,
-    14,14,14,14,14,14,14,14,14,14,14,14,14,14,14 },
-  curve4[37] = { 36,
-    0,1,1,2,3,3,4,4,5,6,6,7,7,7,8,8,9,9,9,10,10,10,
-    11,11,11,11,11,12,12,12,12,12,12,12,12,12 },
-  curve5[111] = { 110,
-    0,1,1,2,3,3,4,5,6,6,7,7,8,9,9,10,11,11,12,12,13,13,
-    14,14,15,15,16,16,17,17,18,18,18,19,19,19,20,20,20,
-    21,21,21,21,22,22,22,22,22,23,23,23,23,23,24,24,24,24,
-    24,24,24,24,25,25,25,25,25,25,25,25,25,25,25,25,26,26,
-    26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,
-    26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26 },
-  *curves[3] = { curve3, curve4, curve5 },
-  trans[3][3] =
-  { {   7576,  -2933,   1279  },
-    { -11594,  29911, -12394  },
-    {   4000, -18850,  20772  } };
-  ushort *pix, prev[3], (*shrink)[3];
-  int row, col, c, i, j, diff, sum, ipix[3], work[3][3], total[4];
-  int (*smrow[7])[3], smlast, smred, smred_p=0, hood[7], min, max;
-
-  /* Sharpen all colors */
-  for (row=0; row < height; row++) {
-    pix = image[row*width];
-    memcpy (prev, pix, sizeof prev);
-    for (col=0; col < width; col++) {
-      for (c=0; c < 3; c++) {
-	diff = pix[c] - prev[c];
-	prev[c] = pix[c];
-	ipix[c] = pix[c] + ((diff + (diff*diff >> 14)) * 0x3333 >> 14);
-      }
-      for (c=0; c < 3; c++) {
-	work[0][c] = ipix[c]*ipix[c] >> 14;
-	work[2][c] = ipix[c]*work[0][c] >> 14;
-	work[1][2-c] = ipix[(c+1) % 3] * ipix[(c+2) % 3] >> 14;
-      }
-      for (c=0; c < 3; c++) {
-	for (sum=i=0; i < 3; i++)
-	  for (  j=0; j < 3; j++)
-	    sum += weight[c][i][j] * work[i][j];
-	ipix[c] = (ipix[c] + (sum >> 14)) * mul[c];
-	if (ipix[c] < 0)     ipix[c] = 0;
-	if (ipix[c] > 32000) ipix[c] = 32000;
-	pix[c] = ipix[c];
-      }
-      pix += 4;
+      {   -631,  -2025,    822  } } };
+  ushort prev[3];
+  int col, c, i, j, diff, sum, ipix[3], work[3][3];
+
+  memcpy (prev, pix, sizeof prev);
+  for (col=0; col < dc->width; col++) {
+    for (c=0; c < 3; c++) {
+      diff = pix[c] - prev[c];
+      prev[c] = pix[c];
+      ipix[c] = pix[c] + ((diff + (diff*diff >> 14)) * 0x3333 >> 14);
+    }
+    for (c=0; c < 3; c++) {
+      work[0][c] = ipix[c]*ipix[c] >> 14;
+      work[2][c] = ipix[c]*work[0][c] >> 14;
+      work[1][2-c] = ipix[(c+1) % 3] * ipix[(c+2) % 3] >> 14;
+    }
+    for (c=0; c < 3; c++) {
+      for (sum=i=0; i < 3; i++)
+	for (  j=0; j < 3; j++)
+	  sum += weight[c][i][j] * work[i][j];
+      ipix[c] = (ipix[c] + (sum >> 14)) * mul[c];
+      if (ipix[c] < 0)     ipix[c] = 0;
+      if (ipix[c] > 32000) ipix[c] = 32000;
+      pix[c] = ipix[c];
     }
+    pix += 4;
+  }
+}
+
+/*
+   Sharpen all colors, then sharpen the reds against their 5x5
+   Gaussian averages.  The averages come from rows not yet sharpened
+   against them, so the four rows saved either side of the band are
+   sharpened here too, just as the next band will sharpen its own.
+ */
+static void foveon_sharpen_band (struct dcraw *dc, void *arg, int band,
+	int top, int bottom)
+{
+  struct foveon *fv = arg;
+  ushort *pix;
+  int row, col, i, first, last, smlast, smred, smred_p=0;
+  int (*smrow[7])[3];
+
+  for (row=top; row < bottom && !dc->cancelled; row++)
+    foveon_sharpen_row (dc, dc->image[row*dc->width]);
+  for (i=0; i < 4; i++) {
+    row = i < 2 ? top-2+i : bottom-2+i;
+    if (row >= 0 && row < dc->height)
+      foveon_sharpen_row (dc, fv->halo[(band*4+i) * dc->width]);
   }
-  /* Array for 5x5 Gaussian averaging of red values */
-  smrow[6] = calloc (width*5, sizeof **smrow);
-  merror (smrow[6], "foveon_interpolate()");
+  smrow[6] = calloc (dc->width*5, sizeof **smrow);
+  merror (smrow[6], "foveon_sharpen_band()");
   for (i=0; i < 5; i++)
-    smrow[i] = smrow[6] + i*width;
+    smrow[i] = smrow[6] + i*dc->width;
 
-  /* Sharpen the reds against these Gaussian averages */
-  for (smlast=-1, row=2; row < height-2; row++) {
+  first = MAX(top, 2);
+  last = MIN(bottom, dc->height-2);
+  for (smlast=first-3, row=first; row < last && !dc->cancelled; row++) {
     while (smlast < row+2) {
       for (i=0; i < 6; i++)
 	smrow[(i+5) % 6] = smrow[i];
-      pix = image[++smlast*width+2];
-      for (col=2; col < width-2; col++) {
+      pix = foveon_pixel (dc, fv, band, top, bottom, ++smlast, 2);
+      for (col=2; col < dc->width-2; col++) {
 	smrow[4][col][0] =
 	  (pix[0]*6 + (pix[-4]+pix[4])*4 + pix[-8]+pix[8] + 8) >> 4;
 	pix += 4;
       }
     }
-    pix = image[row*width+2];
-    for (col=2; col < width-2; col++) {
+    pix = dc->image[row*dc->width+2];
+    for (col=2; col < dc->width-2; col++) {
       smred = (smrow[2][col][0]*6 + (smrow[1][col][0]+smrow[3][col][0])*4
 		+ smrow[0][col][0]+smrow[4][col][0] + 8) >> 4;
       if (col == 2)
@@ -1301,48 +1521,112 @@ void foveon_interpolate()
       pix += 4;
     }
   }
-  /* Limit each color value to the range of its neighbors */
-  hood[0] = 4;
-  for (i=0; i < 3; i++) {
-    hood[i+1] = (i-width-1)*4;
-    hood[i+4] = (i+width-1)*4;
-  }
-  for (row=1; row < height-1; row++) {
-    pix = image[row*width+1];
-    memcpy (prev, pix-4, sizeof prev);
-    for (col=1; col < width-1; col++) {
-      for (c=0; c < 3; c++) {
-	for (min=max=prev[c], i=0; i < 7; i++) {
-	  j = pix[hood[i]];
-	  if (min > j) min = j;
-	  if (max < j) max = j;
-	}
-	prev[c] = *pix;
-	if (*pix < min) *pix = min;
-	if (*pix > max) *pix = max;
-	pix++;
-      }
-      pix++;
+  free (smrow[6]);
+}
+
+/*
+   Limit each color value to the range of its neighbors.  The row
+   above is taken as already limited, so rows must go in order, but
+   with a copy of the row as it was, its pixels no longer depend on
+   each other and the compiler can vectorize them.  The fourth
+   channel, zero throughout, is limited along with the others.
+ */
+static void foveon_limit (struct dcraw *dc)
+{
+  ushort *pix, *up, *dn, *was, lo, hi;
+  int row, i, n = dc->width*4;
+
+  was = malloc (n * sizeof *was);
+  merror (was, "foveon_limit()");
+  for (row=1; row < dc->height-1 && !dc->cancelled; row++) {
+    pix = dc->image[row*dc->width];
+    up = pix - n;
+    dn = pix + n;
+    memcpy (was, pix, n * sizeof *was);
+    for (i=4; i < n-4; i++) {
+      lo = MIN(was[i-4], was[i+4]);
+      hi = MAX(was[i-4], was[i+4]);
+      lo = MIN(lo, MIN(up[i-4], MIN(up[i], up[i+4])));
+      hi = MAX(hi, MAX(up[i-4], MAX(up[i], up[i+4])));
+      lo = MIN(lo, MIN(dn[i-4], MIN(dn[i], dn[i+4])));
+      hi = MAX(hi, MAX(dn[i-4], MAX(dn[i], dn[i+4])));
+      pix[i] = was[i] < lo ? lo : was[i] > hi ? hi : was[i];
     }
   }
+  free (was);
+}
+
+/*
+   Translate one pixel to a different colorspace.
+ */
+static void foveon_transform (ushort *pix)
+{
+  static const int trans[3][3] =
+  { {   7576,  -2933,   1279  },
+    { -11594,  29911, -12394  },
+    {   4000, -18850,  20772  } };
+  int c, i, j, ipix[3];
+
+  for (c=0; c < 3; c++) {
+    for (i=j=0; j < 3; j++)
+      i += trans[c][j] * pix[j];
+    i = (i+0x1000) >> 13;
+    if (i < 0)     i = 0;
+    if (i > 24000) i = 24000;
+    ipix[c] = i;
+  }
+  for (c=0; c < 3; c++)
+    pix[c] = ipix[c];
+}
+
 /*
    Because photons that miss one detector often hit another,
    the sum R+G+B is much less noisy than the individual colors.
-   So smooth the hues without smoothing the total.
+   So smooth the hues without smoothing the total, then translate
+   each row to the new colorspace once no other row needs it.
  */
-  for (smlast=-1, row=2; row < height-2; row++) {
-    while (smlast < row+2) {
+static void foveon_hue_band (struct dcraw *dc, void *arg, int band,
+	int top, int bottom)
+{
+  static const int curve1[73] = { 72,
+     0,1,2,2,3,4,5,6,6,7,8,9,9,10,11,11,12,13,13,14,14,
+    15,16,16,17,17,18,18,18,19,19,20,20,20,21,21,21,22,
+    22,22,23,23,23,23,23,24,24,24,24,24,25,25,25,25,25,
+    25,25,25,26,26,26,26,26,26,26,26,26,26,26,26,26,26 },
+  curve2[21] = { 20,
+    0,1,1,2,3,3,4,4,5,5,6,6,6,7,7,7,7,7,7,7 };
+  struct foveon *fv = arg;
+  ushort *pix;
+  int row, col, c, i, j, sum, first, last, smlast, ipix[3], total[4];
+  int (*smrow[7])[3];
+
+  smrow[6] = calloc (dc->width*5, sizeof **smrow);
+  merror (smrow[6], "foveon_hue_band()");
+  for (i=0; i < 5; i++)
+    smrow[i] = smrow[6] + i*dc->width;
+
+  first = MAX(top, 2);
+  last = MIN(bottom, dc->height-2);
+  for (smlast=first-3, row=top; row < bottom && !dc->cancelled; row++) {
+    while (row < last && smlast < MAX(row, first)+2) {
       for (i=0; i < 6; i++)
 	smrow[(i+5) % 6] = smrow[i];
-      pix = image[++smlast*width+2];
-      for (col=2; col < width-2; col++) {
+      pix = foveon_pixel (dc, fv, band, top, bottom, ++smlast, 2);
+      for (col=2; col < dc->width-2; col++) {
 	for (c=0; c < 3; c++)
 	  smrow[4][col][c] = pix[c-8]+pix[c-4]+pix[c]+pix[c+4]+pix[c+8];
 	pix += 4;
       }
     }
-    pix = image[row*width+2];
-    for (col=2; col < width-2; col++) {
+    pix = dc->image[row*dc->width];
+    if (row < first || row >= last) {
+      for (col=0; col < dc->width; col++)
+	foveon_transform (pix + col*4);
+      continue;
+    }
+    foveon_transform (pix);
+    foveon_transform (pix + 4);
+    for (pix += 8, col=2; col < dc->width-2; col++) {
       for (total[3]=1500, sum=60, c=0; c < 3; c++) {
 	for (total[c]=i=0; i < 5; i++)
 	  total[c] += smrow[i][col][c];
@@ -1361,192 +1645,757 @@ void foveon_interpolate()
 	if (i < 0) i = 0;
 	pix[c] = i;
       }
+      foveon_transform (pix);
       pix += 4;
     }
+    foveon_transform (pix);
+    foveon_transform (pix + 4);
   }
-  /* Translate the image to a different colorspace */
-  for (pix=image[0]; pix < image[height*width]; pix+=4) {
-    for (c=0; c < 3; c++) {
-      for (i=j=0; j < 3; j++)
-	i += trans[c][j] * pix[j];
-      i = (i+0x1000) >> 13;
-      if (i < 0)     i = 0;
-      if (i > 24000) i = 24000;
-      ipix[c] = i;
-    }
-    for (c=0; c < 3; c++)
-      pix[c] = ipix[c];
-  }
-  /* Smooth the image bottom-to-top and save at 1/4 scale */
-  shrink = calloc ((width/4) * (height/4), sizeof *shrink);
-  merror (shrink, "foveon_interpolate()");
-  for (row = height/4; row--; )
-    for (col=0; col < width/4; col++) {
+  free (smrow[6]);
+}
+
+/*
+   Smooth the image bottom-to-top and save at 1/4 scale.  Each
+   column is its own recurrence, so bands here are of columns.
+ */
+static void foveon_shrink_band (struct dcraw *dc, void *arg, int band,
+	int left, int right)
+{
+  struct foveon *fv = arg;
+  ushort (*shrink)[3] = fv->shrink;
+  int row, col, c, i, j, ipix[3];
+
+  for (row = dc->height/4; row-- && !dc->cancelled; )
+    for (col=left; col < right; col++) {
       ipix[0] = ipix[1] = ipix[2] = 0;
       for (i=0; i < 4; i++)
 	for (j=0; j < 4; j++)
 	  for (c=0; c < 3; c++)
-	    ipix[c] += image[(row*4+i)*width+col*4+j][c];
+	    ipix[c] += dc->image[(row*4+i)*dc->width+col*4+j][c];
       for (c=0; c < 3; c++)
-	if (row+2 > height/4)
-	  shrink[row*(width/4)+col][c] = ipix[c] >> 4;
+	if (row+2 > dc->height/4)
+	  shrink[row*(dc->width/4)+col][c] = ipix[c] >> 4;
 	else
-	  shrink[row*(width/4)+col][c] =
-	    (shrink[(row+1)*(width/4)+col][c]*1840 + ipix[c]*141) >> 12;
+	  shrink[row*(dc->width/4)+col][c] =
+	    (shrink[(row+1)*(dc->width/4)+col][c]*1840 + ipix[c]*141) >> 12;
     }
+}
 
-  /* From the 1/4-scale image, smooth right-to-left */
-  for (row=0; row < (height & ~3); row++) {
+/*
+   From the 1/4-scale image, smooth right-to-left, then left-to-right,
+   at full width.  This is the same for all four rows of the image
+   behind each row of shrink[], so it is done once for the four.
+ */
+static void foveon_across_band (struct dcraw *dc, void *arg, int band,
+	int top, int bottom)
+{
+  struct foveon *fv = arg;
+  ushort (*across)[3];
+  int row, col, c, width = dc->width & ~3, ipix[3];
+  int (*smrow)[3];
+
+  smrow = malloc (width * sizeof *smrow);
+  merror (smrow, "foveon_across_band()");
+  for (row=top; row < bottom && !dc->cancelled; row++) {
     ipix[0] = ipix[1] = ipix[2] = 0;
-    if ((row & 3) == 0)
-      for (col = width & ~3 ; col--; )
-	for (c=0; c < 3; c++)
-	  smrow[0][col][c] = ipix[c] =
-	    (shrink[(row/4)*(width/4)+col/4][c]*1485 + ipix[c]*6707) >> 13;
-
-  /* Then smooth left-to-right */
+    for (col=width; col--; )
+      for (c=0; c < 3; c++)
+	smrow[col][c] = ipix[c] =
+	  (fv->shrink[row*(dc->width/4)+col/4][c]*1485 + ipix[c]*6707) >> 13;
+    across = fv->across + row*width;
     ipix[0] = ipix[1] = ipix[2] = 0;
-    for (col=0; col < (width & ~3); col++)
+    for (col=0; col < width; col++)
       for (c=0; c < 3; c++)
-	smrow[1][col][c] = ipix[c] =
-	  (smrow[0][col][c]*1485 + ipix[c]*6707) >> 13;
-
-  /* Smooth top-to-bottom */
-    if (row == 0)
-      memcpy (smrow[2], smrow[1], sizeof **smrow * width);
-    else
-      for (col=0; col < (width & ~3); col++)
-	for (c=0; c < 3; c++)
-	  smrow[2][col][c] =
-	    (smrow[2][col][c]*6707 + smrow[1][col][c]*1485) >> 13;
+	across[col][c] = ipix[c] =
+	  (smrow[col][c]*1485 + ipix[c]*6707) >> 13;
+  }
+  free (smrow);
+}
 
-  /* Adjust the chroma toward the smooth values */
-    for (col=0; col < (width & ~3); col++) {
+/*
+   Smooth top-to-bottom and adjust the chroma toward the smooth
+   values.  Bands are of columns, each with its own running average.
+ */
+static void foveon_chroma_band (struct dcraw *dc, void *arg, int band,
+	int left, int right)
+{
+  static const int curve3[73] = { 72,
+     0,1,1,2,2,3,4,4,5,5,6,6,7,7,8,8,8,9,9,10,10,10,10,
+    11,11,11,12,12,12,12,12,12,13,13,13,13,13,13,13,13,
+    14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,14,
+    14,14,14,14,14,14,14,14,14,14,14,14,14,14,14 },
+  curve4[37] = { 36,
+    0,1,1,2,3,3,4,4,5,6,6,7,7,7,8,8,9,9,9,10,10,10,
+    11,11,11,11,11,12,12,12,12,12,12,12,12,12 },
+  curve5[111] = { 110,
+    0,1,1,2,3,3,4,5,6,6,7,7,8,9,9,10,11,11,12,12,13,13,
+    14,14,15,15,16,16,17,17,18,18,18,19,19,19,20,20,20,
+    21,21,21,21,22,22,22,22,22,23,23,23,23,23,24,24,24,24,
+    24,24,24,24,25,25,25,25,25,25,25,25,25,25,25,25,26,26,
+    26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,
+    26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26,26 },
+  *curves[3] = { curve3, curve4, curve5 };
+  struct foveon *fv = arg;
+  ushort *pix, (*across)[3];
+  int row, col, c, i, j, sum, ipix[3];
+  int (*smooth)[3];
+
+  smooth = malloc ((right-left) * sizeof *smooth);
+  merror (smooth, "foveon_chroma_band()");
+  smooth -= left;
+  for (row=0; row < (dc->height & ~3) && !dc->cancelled; row++) {
+    across = fv->across + (row/4)*(dc->width & ~3);
+    for (col=left; col < right; col++)
+      for (c=0; c < 3; c++)
+	smooth[col][c] = row == 0 ? across[col][c] :
+	    (smooth[col][c]*6707 + across[col][c]*1485) >> 13;
+    for (col=left; col < right; col++) {
+      pix = dc->image[row*dc->width+col];
       for (i=j=60, c=0; c < 3; c++) {
-	i += smrow[2][col][c];
-	j += image[row*width+col][c];
+	i += smooth[col][c];
+	j += pix[c];
       }
       j = (j << 16) / i;
       for (sum=c=0; c < 3; c++) {
-	i = (smrow[2][col][c] * j >> 16) - image[row*width+col][c];
+	i = (smooth[col][c] * j >> 16) - pix[c];
 	ipix[c] = apply_curve (i, curves[c]);
 	sum += ipix[c];
       }
       sum >>= 3;
       for (c=0; c < 3; c++) {
-	i = image[row*width+col][c] + ipix[c] - sum;
+	i = pix[c] + ipix[c] - sum;
 	if (i < 0) i = 0;
-	image[row*width+col][c] = i;
+	pix[c] = i;
       }
     }
   }
-  free(shrink);
-  free(smrow[6]);
+  free (smooth + left);
 }
 
 /*
-   Seach from the current directory up to the root looking for
-   a ".badpixels" file, and fix those pixels now.
+   Each pass but one runs in bands on all threads.  Passes that look
+   at the rows near each pixel save the rows just outside their band
+   before any band starts, and the per-pixel color transform is done
+   as each row is finished with, not as a pass of its own.
  */
-void bad_pixels()
+static void foveon_interpolate(struct dcraw *dc)
 {
-  FILE *fp;
-  char *fname, *cp, line[128];
-  int len, time, row, col, r, c, rad, tot, n, fixed=0;
-
-  for (len=16 ; ; len *= 2) {
-    fname = malloc (len);
-    if (!fname) return;
-    if (getcwd (fname, len-12)) break;
-    free (fname);
-    if (errno != ERANGE) return;
-  }
-  if (*fname != '/') return;
-  cp = fname + strlen(fname);
-  if (cp[-1] == '/') cp--;
-  while (1) {
-    strcpy (cp, "/.badpixels");
-    if ((fp = fopen (fname, "r"))) break;
-    if (cp == fname) break;
-    while (*--cp != '/');
-  }
-  free (fname);
-  if (!fp) return;
-  while (1) {
-    fgets (line, 128, fp);
-    if (feof(fp)) break;
-    cp = strchr (line, '#');
-    if (cp) *cp = 0;
-    if (sscanf (line, "%d %d %d", &col, &row, &time) != 3) continue;
-    if ((unsigned) col >= width || (unsigned) row >= height) continue;
-    if (time > timestamp) continue;
-    for (tot=n=0, rad=1; rad < 3 && n==0; rad++)
-      for (r = row-rad; r <= row+rad; r++)
-	for (c = col-rad; c <= col+rad; c++)
-	  if ((unsigned) r < height && (unsigned) c < width &&
-		(r != row || c != col) && FC(r,c) == FC(row,col)) {
-	    tot += image[r*width+c][FC(r,c)];
-	    n++;
-	  }
-    image[row*width+col][FC(row,col)] = tot/n;
-    if (!fixed++)
-      fprintf (stderr, "Fixed bad pixels at:");
-    fprintf (stderr, " %d,%d", col, row);
-  }
-  if (fixed) fputc ('\n', stderr);
-  fclose (fp);
+  struct foveon fv;
+  int w4 = dc->width/4, h4 = dc->height/4;
+
+  fv.halo = malloc (nbands(dc, dc->height) * 4 * dc->width * sizeof *fv.halo);
+  merror (fv.halo, "foveon_interpolate()");
+  run_bands (dc, foveon_save_band, &fv, 0, dc->height);
+  run_bands (dc, foveon_sharpen_band, &fv, 0, dc->height);
+  foveon_limit (dc);
+  run_bands (dc, foveon_save_band, &fv, 0, dc->height);
+  run_bands (dc, foveon_hue_band, &fv, 0, dc->height);
+  free (fv.halo);
+
+  fv.shrink = get_block (dc, &dc->scratch,
+	(w4*h4 + h4*(dc->width & ~3)) * sizeof *fv.shrink, 0);
+  fv.across = fv.shrink + w4*h4;
+  run_bands (dc, foveon_shrink_band, &fv, 0, w4);
+  run_bands (dc, foveon_across_band, &fv, 0, h4);
+  run_bands (dc, foveon_chroma_band, &fv, 0, dc->width & ~3);
 }
 
 /*
-   Automatic color balance, currently used only in Document Mode.
+   The ".badpixels" list is read once per run, because the current
+   directory never changes.  Entries are kept sorted by position.
  */
-void auto_scale()
+struct dcraw_badpix {
+  int row, col, time;
+};
+
+#define BADPIX_MAGIC "DCRAWBP2"
+
+static int badpix_pos (const void *a, const void *b)
 {
-  int row, col, c, val;
-  int min[4], max[4], count[4];
-  double sum[4], maxd=0;
+  const struct dcraw_badpix *pa = a, *pb = b;
 
-  for (c=0; c < 4; c++) {
-    min[c] = INT_MAX;
-    sum[c] = max[c] = count[c] = 0;
-  }
-  for (row=0; row < height; row++)
-    for (col=0; col < width; col++)
-      for (c=0; c < colors; c++) {
-	val = image[row*width+col][c];
-	if (!val) continue;
-	val -= black;
-	if (val < 0) val = 0;
-	if (min[c] > val) min[c] = val;
-	if (max[c] < val) max[c] = val;
-	sum[c] += val;
-	count[c]++;
-      }
-  for (c=0; c < colors; c++) {		/* Smallest pre_mul[] value */
-    pre_mul[c] = sum[c]/count[c];	/* should be 1.0 */
-    if (maxd < pre_mul[c])
-        maxd = pre_mul[c];
+  if (pa->row != pb->row) return pa->row - pb->row;
+  return pa->col - pb->col;
+}
+
+static int badpix_cmp (const void *a, const void *b)
+{
+  const struct dcraw_badpix *pa = a, *pb = b;
+
+  if (pa->row != pb->row || pa->col != pb->col)
+    return badpix_pos (a, b);
+  return pa->time - pb->time;
+}
+
+/*
+   What a compiled list records of the text file it was made from:
+   its size and modification time, to the nanosecond where the system
+   keeps that, so that an edit within the same second still shows.
+ */
+static void badpix_stamp (struct stat *st, int stamp[3])
+{
+  stamp[0] = st ? st->st_size : -1;
+  stamp[1] = st ? st->st_mtime : 0;
+  stamp[2] = 0;
+#ifdef _STATBUF_ST_NSEC
+  if (st) stamp[2] = st->st_mtim.tv_nsec;
+#endif
+}
+
+/*
+   Read a ".badpixels" file, either as text or in the compiled
+   form written by "-B".  A compiled list is taken only if it is
+   whole and, when there is a text file (described by *text), was
+   made from that file as it is now.  Return nonzero if the file
+   was read.
+ */
+static int read_badpixels (struct dcraw *dc, char *fname, int compiled,
+	struct stat *text)
+{
+  FILE *fp;
+  char line[128], *cp;
+  struct dcraw_badpix bp;
+  struct stat st;
+  int size=0, i, head[6], stamp[3];
+
+  if (!(fp = fopen (fname, compiled ? "rb":"r"))) return 0;
+  dc->nbadpix = 0;
+  if (compiled) {
+    badpix_stamp (text, stamp);
+    if (fstat (fileno(fp), &st) || fread (head, 4, 6, fp) != 6 ||
+	memcmp (head, BADPIX_MAGIC, 8)) {
+      fclose (fp);
+      return 0;
+    }
+    for (i=2; i < 6; i++)
+      head[i] = ntohl(head[i]);
+    size = head[5];
+    if ((text && memcmp (head+2, stamp, sizeof stamp)) || size < 0 ||
+	size > (st.st_size - sizeof head) / sizeof *dc->badpix) {
+      fclose (fp);
+      return 0;
+    }
+    free (dc->badpix);
+    dc->badpix = malloc (size * sizeof *dc->badpix + 1);
+    merror (dc->badpix, "read_badpixels()");
+    if (fread (dc->badpix, sizeof *dc->badpix, size, fp) != size) {
+      fclose (fp);
+      return 0;
+    }
+    dc->nbadpix = size;
+    for (i=0; i < dc->nbadpix; i++) {
+      dc->badpix[i].row  = ntohl(dc->badpix[i].row);
+      dc->badpix[i].col  = ntohl(dc->badpix[i].col);
+      dc->badpix[i].time = ntohl(dc->badpix[i].time);
+    }
+  } else
+    while (fgets (line, 128, fp)) {
+      cp = strchr (line, '#');
+      if (cp) *cp = 0;
+      if (sscanf (line, "%d %d %d", &bp.col, &bp.row, &bp.time) != 3)
+	continue;
+      if (dc->nbadpix == size) {
+	size = size*2 + 64;
+	dc->badpix = realloc (dc->badpix, size * sizeof *dc->badpix);
+	merror (dc->badpix, "read_badpixels()");
+      }
+      dc->badpix[dc->nbadpix++] = bp;
+    }
+  fclose (fp);
+  qsort (dc->badpix, dc->nbadpix, sizeof *dc->badpix, badpix_cmp);
+  return 1;
+}
+
+/*
+   Seach from the current directory up to the root looking for
+   a ".badpixels" file.  A compiled ".badpixels.bin" in the same
+   directory is used instead if it was made from the text file as
+   it is now, or if there is no text file.
+ */
+static void find_badpixels(struct dcraw *dc)
+{
+  struct stat st[2];
+  char *fname, *cp;
+  int len, have[2];
+
+  dc->nbadpix = 0;
+  for (len=32 ; ; len *= 2) {
+    fname = malloc (len);
+    if (!fname) return;
+    if (getcwd (fname, len-16)) break;
+    free (fname);
+    if (errno != ERANGE) return;
+  }
+  if (*fname != '/') {
+    free (fname);
+    return;
+  }
+  cp = fname + strlen(fname);
+  if (cp[-1] == '/') cp--;
+  while (1) {
+    strcpy (cp, "/.badpixels");
+    have[0] = !stat (fname, &st[0]);
+    strcpy (cp, "/.badpixels.bin");
+    have[1] = !stat (fname, &st[1]);
+    if (have[1] && read_badpixels (dc, fname, 1, have[0] ? st : 0)) break;
+    cp[11] = 0;
+    if (have[0] && read_badpixels (dc, fname, 0, 0)) break;
+    if (cp == fname) break;
+    while (*--cp != '/');
+  }
+  if (dc->nbadpix || have[0] || have[1]) {
+    *cp = 0;
+    dc->badpix_dir = fname;
+  } else
+    free (fname);
+}
+
+/*
+   Write the list to ".badpixels.bin" in dir, stamped with the text
+   file there if there is one.  Returns nonzero on success.
+ */
+static int write_badpixels (struct dcraw *dc, char *dir)
+{
+  FILE *fp;
+  char *fname;
+  struct dcraw_badpix bp;
+  struct stat st;
+  int i, head[4], have;
+
+  fname = malloc (strlen(dir) + 16);
+  merror (fname, "write_badpixels()");
+  sprintf (fname, "%s/.badpixels", dir);
+  have = !stat (fname, &st);
+  badpix_stamp (have ? &st : 0, head);
+  head[3] = dc->nbadpix;
+  strcat (fname, ".bin");
+  if ((fp = fopen (fname, "wb"))) {
+    fwrite (BADPIX_MAGIC, 1, 8, fp);
+    for (i=0; i < 4; i++)
+      head[i] = htonl(head[i]);
+    fwrite (head, 4, 4, fp);
+    for (i=0; i < dc->nbadpix; i++) {
+      bp.row  = htonl(dc->badpix[i].row);
+      bp.col  = htonl(dc->badpix[i].col);
+      bp.time = htonl(dc->badpix[i].time);
+      fwrite (&bp, sizeof bp, 1, fp);
+    }
+    fclose (fp);
+  } else
+    perror (fname);
+  free (fname);
+  return fp != 0;
+}
+
+#ifndef NO_MAIN
+/*
+   Write the list found for this directory in compiled form.
+ */
+static void compile_badpixels(struct dcraw *dc)
+{
+  if (dc->nbadpix < 0) find_badpixels(dc);
+  if (!dc->badpix_dir) {
+    fprintf (stderr, "No .badpixels file found.\n");
+    return;
   }
-  for (c=0; c < colors; c++)
-    pre_mul[c] = maxd / pre_mul[c];
+  if (write_badpixels (dc, dc->badpix_dir))
+    fprintf (stderr, "Wrote %d bad pixels to %s/.badpixels.bin\n",
+	dc->nbadpix, dc->badpix_dir);
 }
+#endif
 
-void scale_colors()
+/*
+   Work out replacements for the pixels listed in ".badpixels" that
+   were already bad when this photo was taken.  Each is the average
+   of its nearest same-color neighbors as they will be once the dark
+   frame is subtracted, and earlier replacements stand in for their
+   originals.  The list is filtered once per timestamp.  Returns the
+   number of bad pixels, with their new values in *valp.  Only raw
+   CFA samples are patched.
+ */
+static int bad_pixels (struct dcraw *dc, ushort *dark,
+	struct dcraw_badpix **fixp, ushort **valp)
 {
-  int row, col, c, val;
+  struct dcraw_badpix key, *bp;
+  int i, row, col, r, c, rad, tot, n, val;
+
+  if (!dc->raw_image) return 0;
+  if (dc->nbadpix < 0) find_badpixels(dc);
+  if (!dc->nbadpix) return 0;
+  if (!dc->fix || dc->fix_key[0] != dc->timestamp ||
+	dc->fix_key[1] != dc->width || dc->fix_key[2] != dc->height ||
+	dc->fix_key[3] != dc->nbadpix) {
+    free (dc->fix);
+    free (dc->fixval);
+    dc->fix = malloc (dc->nbadpix * sizeof *dc->fix);
+    dc->fixval = malloc (dc->nbadpix * sizeof *dc->fixval);
+    merror (dc->fix, "bad_pixels()");
+    merror (dc->fixval, "bad_pixels()");
+    for (dc->nfix=i=0; i < dc->nbadpix; i++) {
+      if ((unsigned) dc->badpix[i].col >= dc->width ||
+	  (unsigned) dc->badpix[i].row >= dc->height ||
+	  dc->badpix[i].time > dc->timestamp) continue;
+      if (dc->nfix && dc->fix[dc->nfix-1].row == dc->badpix[i].row
+	       && dc->fix[dc->nfix-1].col == dc->badpix[i].col) continue;
+      dc->fix[dc->nfix++] = dc->badpix[i];
+    }
+    dc->fix_key[0] = dc->timestamp;
+    dc->fix_key[1] = dc->width;
+    dc->fix_key[2] = dc->height;
+    dc->fix_key[3] = dc->nbadpix;
+  }
+  for (i=0; i < dc->nfix; i++) {
+    row = dc->fix[i].row;
+    col = dc->fix[i].col;
+    for (tot=n=0, rad=1; rad < 3 && n==0; rad++)
+      for (r = row-rad; r <= row+rad; r++)
+	for (c = col-rad; c <= col+rad; c++)
+	  if ((unsigned) r < dc->height && (unsigned) c < dc->width &&
+		(r != row || c != col) && FC(r,c) == FC(row,col)) {
+	    key.row = r;
+	    key.col = c;
+	    if ((bp = bsearch (&key, dc->fix, i, sizeof *dc->fix, badpix_pos)))
+	      val = dc->fixval[bp - dc->fix];
+	    else {
+	      val = BAYER(r,c);
+	      if (dark && (val -= dark[r*dc->width+c]) < 0) val = 0;
+	    }
+	    tot += val;
+	    n++;
+	  }
+    dc->fixval[i] = tot/n;
+    if (!i)
+      fprintf (stderr, "Fixed bad pixels at:");
+    fprintf (stderr, " %d,%d", col, row);
+  }
+  if (dc->nfix) fputc ('\n', stderr);
+  *fixp = dc->fix;
+  *valp = dc->fixval;
+  return dc->nfix;
+}
 
-  rgb_max -= black;
-  for (row=0; row < height; row++)
-    for (col=0; col < width; col++)
-      for (c=0; c < colors; c++) {
-	val = image[row*width+col][c];
-	if (!val) continue;
-	val -= black;
-	val *= pre_mul[c];
-	if (val < 0) val = 0;
-	if (val > rgb_max) val = rgb_max;
-	image[row*width+col][c] = val;
+/*
+   Look for hot and dead pixels by comparing each sample with the
+   same-color samples within two pixels of it.  New ones are added
+   to ".badpixels", dated with this photo's timestamp.
+
+   Each row is done one column phase at a time, so the neighbor
+   offsets are fixed and the inner loops have no branches.
+ */
+static void find_bad_pixels (struct dcraw *dc, char *ifname)
+{
+  int hood[16][24], nhood[16], *lo, *hi, *ip;
+  int row, col, phase, color, x, y, i, v, thresh, r16, nnew=0, size=0;
+  int have_bin;
+  struct dcraw_badpix bp, *found=0;
+  struct stat st;
+  char *dir, *fname;
+  FILE *fp;
+  ushort *pix;
+
+  if (!dc->filters || dc->height < 5 || dc->width < 5) return;
+  if (dc->nbadpix < 0) find_badpixels(dc);
+  for (phase=0; phase < 16; phase++) {
+    color = FC(phase >> 1, phase & 1);
+    for (nhood[phase]=0, y=-2; y <= 2; y++)
+      for (x=-2; x <= 2; x++)
+	if ((x || y) && FC((phase >> 1)+8+y, (phase & 1)+x) == color)
+	  hood[phase][nhood[phase]++] = y*dc->width + x;
+  }
+  lo = malloc (dc->width * 2 * sizeof *lo);
+  merror (lo, "find_bad_pixels()");
+  hi = lo + dc->width;
+  r16 = dc->hot_ratio * 16;
+  thresh = dc->rgb_max;		/* 1/16 of full scale, times 16 */
+  for (row=2; row < dc->height-2; row++)
+    for (phase = (row & 7)*2; phase < (row & 7)*2+2; phase++) {
+      pix = dc->raw_image + row*dc->width;
+      for (col = 2 + (phase & 1); col < dc->width-2; col += 2) {
+	lo[col] = INT_MAX;
+	hi[col] = 0;
+      }
+      for (ip=hood[phase]; ip < hood[phase]+nhood[phase]; ip++)
+	for (col = 2 + (phase & 1); col < dc->width-2; col += 2) {
+	  v = pix[col + *ip];
+	  if (lo[col] > v) lo[col] = v;
+	  if (hi[col] < v) hi[col] = v;
+	}
+      for (col = 2 + (phase & 1); col < dc->width-2; col += 2) {
+	v = pix[col];
+	if (v*16 <= hi[col]*r16 + thresh && v*r16 + thresh >= lo[col]*16)
+	  continue;
+	bp.row = row;
+	bp.col = col;
+	bp.time = dc->timestamp;
+	if (dc->nbadpix &&
+	    bsearch (&bp, dc->badpix, dc->nbadpix, sizeof bp, badpix_pos))
+	  continue;
+	if (nnew == size) {
+	  size = size*2 + 64;
+	  found = realloc (found, size * sizeof *found);
+	  merror (found, "find_bad_pixels()");
+	}
+	found[nnew++] = bp;
+      }
+    }
+  free (lo);
+  if (!nnew) return;
+  dc->badpix = realloc (dc->badpix, (dc->nbadpix + nnew) * sizeof *dc->badpix);
+  merror (dc->badpix, "find_bad_pixels()");
+  memcpy (dc->badpix + dc->nbadpix, found, nnew * sizeof *found);
+  dc->nbadpix += nnew;
+  qsort (dc->badpix, dc->nbadpix, sizeof *dc->badpix, badpix_cmp);
+/*
+   Add the new pixels to the text file unless there is only a
+   compiled list, then compile the whole list again if there is
+   one, so that neither form hides the other.
+ */
+  dir = dc->badpix_dir ? dc->badpix_dir : ".";
+  fname = malloc (strlen(dir) + 16);
+  merror (fname, "find_bad_pixels()");
+  sprintf (fname, "%s/.badpixels.bin", dir);
+  have_bin = !stat (fname, &st);
+  fname[strlen(fname)-4] = 0;
+  if (!have_bin || !stat (fname, &st)) {
+    if ((fp = fopen (fname, "a+"))) {
+      if (!fseek (fp, -1, SEEK_END) && fgetc(fp) != '\n') {
+	fseek (fp, 0, SEEK_END);
+	fputc ('\n', fp);
+      }
+      fseek (fp, 0, SEEK_END);
+      for (i=0; i < nnew; i++)
+	fprintf (fp, "%d %d %d\t# %s\n",
+	  found[i].col, found[i].row, found[i].time, ifname);
+      fclose (fp);
+      fprintf (stderr, "Added %d bad pixels to %s\n", nnew, fname);
+    } else
+      perror (fname);
+  }
+  if (have_bin && write_badpixels (dc, dir))
+    fprintf (stderr, "Added %d bad pixels to %s.bin\n", nnew, fname);
+  free (fname);
+  free (found);
+}
+
+/*
+   A master dark frame is the average of several exposures taken
+   with the lens cap on.  Its samples follow this header in native
+   byte order, so that the file can be mapped and used directly.
+ */
+struct dcraw_dark_head {
+  char magic[8];		/* "DCRAWDK1" */
+  int byte_order;		/* 0x01020304 as written */
+  int width, height, frames;
+  unsigned filters;
+  char model[36];
+};
+
+/*
+   Return the samples of the master dark frame, if it fits this
+   image.  The dark frame includes the black level, so black is
+   zero once it has been subtracted.  The file is mapped on first
+   use and kept for the rest of the run.
+ */
+static ushort *load_dark(struct dcraw *dc)
+{
+  struct dcraw_dark_head *dh = dc->dark_head;
+  struct dcraw_view *vp = &dc->dark_view;
+  FILE *fp;
+
+  if (!dh) {
+    if (!(fp = fopen (dc->dark_name, "rb"))) {
+      perror (dc->dark_name);
+      dc->dark_name = 0;
+      return 0;
+    }
+    fseek (fp, 0, SEEK_END);
+    dh = (struct dcraw_dark_head *) open_view (vp, fp, 0, ftell(fp));
+    fclose (fp);
+    if (vp->size < sizeof *dh || memcmp (dh->magic, "DCRAWDK1", 8) ||
+	dh->byte_order != 0x01020304 ||
+	vp->size < sizeof *dh + (size_t) dh->width * dh->height * 2) {
+      fprintf (stderr, "%s is not a master dark frame.\n", dc->dark_name);
+      close_view (vp);
+      dc->dark_name = 0;
+      return 0;
+    }
+    dc->dark_head = dh;
+  }
+  if (dh->width != dc->width || dh->height != dc->height ||
+	dh->filters != dc->filters) {
+    fprintf (stderr, "Master dark frame from %s does not fit this image.\n",
+	dh->model);
+    return 0;
+  }
+  fprintf (stderr, "Subtracting average of %d dark frames...\n", dh->frames);
+  dc->black = 0;
+  return (ushort *) (dh + 1);
+}
+
+/*
+   Subtract the dark frame ahead of preprocess(), for find_bad_pixels().
+ */
+static void subtract_dark (struct dcraw *dc, ushort *dark)
+{
+  int i, val;
+
+  for (i=0; i < dc->height*dc->width; i++) {
+    val = dc->raw_image[i] - dark[i];
+    dc->raw_image[i] = val > 0 ? val : 0;
+  }
+}
+
+struct scale_stats {
+  INT64 sum[4];
+  int count[4];
+};
+
+/*
+   Automatic color balance, currently used only in Document Mode.
+   The averages come from preprocess(), which gathers them in bands
+   and only from one group of eight rows in every sample_rows.
+ */
+static void auto_scale (struct dcraw *dc, struct scale_stats *st, int nst)
+{
+  INT64 sum[4];
+  int count[4], i, c;
+  double maxd=0;
+
+  for (c=0; c < 4; c++) {
+    sum[c] = count[c] = 0;
+    for (i=0; i < nst; i++) {
+      sum[c] += st[i].sum[c];
+      count[c] += st[i].count[c];
+    }
+  }
+  for (c=0; c < dc->colors; c++) {		/* Smallest pre_mul[] value */
+    dc->pre_mul[c] = (double) sum[c]/count[c];	/* should be 1.0 */
+    if (maxd < dc->pre_mul[c])
+        maxd = dc->pre_mul[c];
+  }
+  for (c=0; c < dc->colors; c++)
+    dc->pre_mul[c] = maxd / dc->pre_mul[c];
+}
+
+struct prep {
+  ushort *lut, *dark, *fixval;
+  struct dcraw_badpix *fix;
+  int nfix;
+  struct scale_stats stats[MAX_THREADS];
+};
+
+static void preprocess_band (struct dcraw *dc, void *arg, int band, int top,
+	int bottom)
+{
+  struct prep *pp = arg;
+  struct scale_stats *st = pp->stats + band;
+  struct dcraw_badpix *fp = pp->fix, *fend = pp->fix + pp->nfix;
+  ushort *pix, *dp, *curve;
+  int row, col, phase, c, val, sample;
+
+  memset (st, 0, sizeof *st);
+  while (fp < fend && fp->row < top) fp++;
+  for (row=top; row < bottom && !dc->cancelled; row++) {
+    if (pp->dark) {
+      pix = dc->raw_image + row*dc->width;
+      dp = pp->dark + row*dc->width;
+      for (col=0; col < dc->width; col++) {
+	val = pix[col] - dp[col];
+	pix[col] = val > 0 ? val : 0;
+      }
+    }
+    for ( ; fp < fend && fp->row == row; fp++)
+      BAYER(row,fp->col) = pp->fixval[fp - pp->fix];
+    sample = dc->document_mode && !((row >> 3) % dc->sample_rows);
+    if (dc->raw_image)
+      for (phase=0; phase < 2; phase++) {
+	c = FC(row,phase);
+	curve = pp->lut + (c << 16);
+	pix = dc->raw_image + row*dc->width;
+	if (sample)
+	  for (col=phase; col < dc->width; col+=2) {
+	    if ((val = pix[col])) {
+	      st->sum[c] += curve[val];
+	      st->count[c]++;
+	    }
+	    pix[col] = curve[val];
+	  }
+	else
+	  for (col=phase; col < dc->width; col+=2)
+	    pix[col] = curve[pix[col]];
+      }
+    else
+      for (pix=dc->image[row*dc->width];
+	   pix < dc->image[(row+1)*dc->width]; pix+=4)
+	for (c=0; c < dc->colors; c++) {
+	  val = pix[c];
+	  pix[c] = pp->lut[c << 16 | val];
+	  if (sample && val) {
+	    st->sum[c] += pix[c];
+	    st->count[c]++;
+	  }
+	}
+  }
+}
+
+/*
+   Everything done to the raw samples before interpolation happens
+   here in one pass, a band of rows at a time:  subtract the dark
+   frame, patch bad pixels, then subtract black, white balance and
+   clip through a table of all 65536 results for each channel.
+   In Document Mode the white balance depends on averages gathered
+   along the way, so it is left for convert_to_rgb().
+ */
+static void preprocess (struct dcraw *dc, ushort *dark)
+{
+  struct prep pp;
+  int c, val, scaled;
+
+  pp.dark = dark;
+  pp.nfix = bad_pixels (dc, dark, &pp.fix, &pp.fixval);
+  fprintf (stderr, "Scaling raw data (black=%d)...\n", dc->black);
+  pp.lut = calloc (4 << 16, sizeof *pp.lut);
+  merror (pp.lut, "preprocess()");
+  dc->rgb_max -= dc->black;
+  for (c=0; c < dc->colors; c++)
+    for (val=1; val < 0x10000; val++) {
+      scaled = val - dc->black;
+      if (scaled < 0) scaled = 0;
+      if (!dc->document_mode) {
+	scaled *= dc->pre_mul[c];
+	if (scaled > dc->rgb_max) scaled = dc->rgb_max;
       }
+      pp.lut[c << 16 | val] = scaled;
+    }
+  memset (pp.stats, 0, sizeof pp.stats);
+  run_bands (dc, preprocess_band, &pp, 0, dc->height);
+  if (dc->document_mode && !dc->cancelled)	/* No bands ran if cancelled */
+    auto_scale (dc, pp.stats, nbands(dc, dc->height));
+  free (pp.lut);
+}
+
+/*
+   Spread the raw samples out into image[], one channel of four with
+   the others zeroed.  The plane is grown in place and filled from
+   the end, so each pixel is written only after every sample it
+   covers has been read.
+ */
+static void expand_raw(struct dcraw *dc)
+{
+  ushort *raw, *pix;
+  int row, col, val;
+
+  dc->image = get_block (dc, &dc->plane,
+	dc->height * dc->width * sizeof *dc->image, 1);
+  raw = dc->image[0];
+  dc->raw_image = 0;
+  for (row=dc->height; row--; )
+    for (col=dc->width; col--; ) {
+      val = raw[row*dc->width+col];
+      pix = dc->image[row*dc->width+col];
+      pix[0] = pix[1] = pix[2] = pix[3] = 0;
+      pix[FC(row,col)] = val;
+    }
 }
 
 /*
@@ -1558,10 +2407,596 @@ void scale_colors()
 
    I've extended the basic idea to work with non-Bayer filter arrays.
    Gradients are numbered clockwise from NW=0 to W=7.
+
+   The terms that apply to each of the sixteen pixels of the filter
+   pattern are unpacked into lists, and the five rows around each row
+   are interpolated bilinearly into planes split by channel and column
+   parity.  Every gradient term and neighbor is then a plain loop over
+   the pixels of one color, which compilers can vectorize.  This works
+   the same for three and four colors.  Since bilinear reads only raw
+   samples, and VNG writes only the other channels, bands of rows run
+   in parallel with no separate bilinear pass and write straight to
+   the image.
+   Wide bands are done in tiles of columns, so that the window stays
+   in cache.
+ */
+struct vng_phase {
+  int nterm, term[64][11];	/* y1,x1, y2,x2, color, shift, count, grads */
+  int chood[8][3];		/* y, x, same color two steps away */
+};
+
+struct vng {
+  int (*lin)[2][32];
+  struct vng_phase phase[8][2];
+};
+
+struct vng_win {
+  ushort *plane;		/* [5 rows][4 colors][2 parities][half] */
+  int half, *gval, *thold, *sum, *num, *diff;
+  int left, right, base;	/* columns done, and column of plane[0] */
+};
+
+#define PLANE(row,c,par) \
+	(wp->plane + (((row) % 5 * 4 + (c)) * 2 + (par)) * wp->half)
+
+/*
+   Pointer to the samples of color c at (row+y,col+x) for the pixels
+   col = left+phase, left+2+phase, ... of this row.  The plane starts
+   four columns left of the tile.
+ */
+#define WIN(y,x,c) \
+	(PLANE(row+(y), c, (phase+(x)) & 1) + ((4+phase+(x)) >> 1))
+
+/*
+   Fill the window with a row as bilinear_band() would leave it,
+   from two columns left of the tile to two columns right of it.
+   Other bands may be writing the interpolated channels of this row
+   in the image, so only the raw samples and the edges are read.
+ */
+static void vng_win_row (struct dcraw *dc, struct vng *vp, struct vng_win *wp,
+	int row)
+{
+  ushort *pix;
+  int *ip, sum[4], lo, hi, col, x, diff, g, c;
+
+  if ((lo = wp->left - 2) < 0) lo = 0;
+  if ((hi = wp->right + 2) > dc->width) hi = dc->width;
+  if (row < 1 || row > dc->height-2) {
+    for (c=0; c < dc->colors; c++)
+      for (col=lo; col < hi; col++)
+	PLANE(row,c,col & 1)[(col - wp->base) >> 1] =
+		dc->image[row*dc->width+col][c];
+    return;
+  }
+  for (col=lo; col < lo+2; col++) {
+    c = FC(row,col);
+    for (x=col; x < hi; x+=2)
+      PLANE(row,c,col & 1)[(x - wp->base) >> 1] = dc->image[row*dc->width+x][c];
+  }
+  for (c=0; c < dc->colors; c++) {
+    if (lo == 0)
+      PLANE(row,c,0)[-wp->base >> 1] = dc->image[row*dc->width][c];
+    if (hi == dc->width)
+      PLANE(row,c,(dc->width-1) & 1)[(dc->width-1 - wp->base) >> 1] =
+	dc->image[row*dc->width+dc->width-1][c];
+  }
+  if (lo < 1) lo = 1;
+  if (hi > dc->width-1) hi = dc->width-1;
+  pix = dc->image[row*dc->width+lo];
+  for (col=lo; col < hi; col++, pix+=4) {
+    ip = vp->lin[row & 7][col & 1];
+    memset (sum, 0, sizeof sum);
+    for (g=8; g--; ) {
+      diff = pix[*ip++];
+      diff <<= *ip++;
+      sum[*ip++] += diff;
+    }
+    for (g=dc->colors; --g; ) {
+      c = *ip++;
+      PLANE(row,c,col & 1)[(col - wp->base) >> 1] = sum[c] / *ip++;
+    }
+  }
+}
+
+static void vng_plane_row (struct dcraw *dc, struct vng *vp, struct vng_win *wp,
+	int row, ushort (*brow)[4])
+{
+  struct vng_phase *ph;
+  ushort *a, *b;
+  int *tp, *gv, *gw, *th, *sum, *num, *diff, *cp;
+  int phase, n, i, j, g, c, color, y, x, sh, d, t, lo, hi;
+
+  th = wp->thold;
+  num = wp->num;
+  diff = wp->diff;
+  for (phase=0; phase < 2; phase++) {
+    ph = &vp->phase[row & 7][phase];
+    n = (wp->right - wp->left - phase + 1) / 2;
+    memset (wp->gval, 0, 8 * n * sizeof *wp->gval);
+    for (i=0; i < ph->nterm; i++) {		/* Calculate gradients */
+      tp = ph->term[i];
+      a = WIN(tp[0],tp[1],tp[4]);
+      b = WIN(tp[2],tp[3],tp[4]);
+      sh = tp[5];
+      gv = wp->gval + tp[7]*n;
+      if (tp[6] == 1)
+	for (j=0; j < n; j++)
+	  gv[j] += abs(a[j] - b[j]) << sh;
+      else if (tp[6] == 2)
+	for (gw = wp->gval + tp[8]*n, j=0; j < n; j++) {
+	  d = abs(a[j] - b[j]) << sh;
+	  gv[j] += d;
+	  gw[j] += d;
+	}
+      else {
+	for (j=0; j < n; j++)
+	  diff[j] = abs(a[j] - b[j]) << sh;
+	for (g=0; g < tp[6]; g++)
+	  for (gv = wp->gval + tp[7+g]*n, j=0; j < n; j++)
+	    gv[j] += diff[j];
+      }
+    }
+    gv = wp->gval;				/* Choose a threshold */
+    for (j=0; j < n; j++) {
+      lo = hi = gv[j];
+      for (g=1; g < 8; g++) {
+	if (lo > gv[g*n+j]) lo = gv[g*n+j];
+	if (hi < gv[g*n+j]) hi = gv[g*n+j];
+      }
+      th[j] = lo + (hi >> 1);
+    }
+    color = FC(row,2+phase);
+    memset (wp->sum, 0, dc->colors * n * sizeof *wp->sum);
+    memset (num, 0, n * sizeof *num);
+    for (g=0; g < 8; g++) {			/* Average the neighbors */
+      gv = wp->gval + g*n;
+      cp = ph->chood[g];
+      y = cp[0];
+      x = cp[1];
+      for (c=0; c < dc->colors; c++) {
+	sum = wp->sum + c*n;
+	if (c == color && cp[2]) {
+	  a = WIN(0,0,c);
+	  b = WIN(y*2,x*2,c);
+	  for (j=0; j < n; j++)
+	    sum[j] += -(gv[j] <= th[j]) & (a[j] + b[j]) >> 1;
+	} else {
+	  a = WIN(y,x,c);
+	  for (j=0; j < n; j++)
+	    sum[j] += -(gv[j] <= th[j]) & a[j];
+	}
+      }
+      for (j=0; j < n; j++)
+	num[j] += gv[j] <= th[j];
+    }
+    a = WIN(0,0,color);				/* Save to image */
+    for (c=0; c < dc->colors; c++) {
+      if (c == color) continue;		/* other bands read the raw sample */
+      sum = wp->sum + c*n;
+      gw = wp->sum + color*n;
+      for (j=0; j < n; j++) {
+	t = a[j] + (sum[j] - gw[j]) / num[j];
+	brow[wp->left+phase+j*2][c] = t > 0 ? (t < 0xffff ? t : 0xffff) : 0;
+      }
+    }
+  }
+}
+
+/*
+   Interpolate columns left through right-1 of a row bilinearly.
+ */
+static void bilinear_row (struct dcraw *dc, struct vng *vp, int row, int left,
+	int right)
+{
+  ushort *pix;
+  int *ip, sum[4], col, diff, g, c;
+
+  pix = dc->image[row*dc->width+left];
+  for (col=left; col < right; col++) {
+    ip = vp->lin[row & 7][col & 1];
+    memset (sum, 0, sizeof sum);
+    for (g=8; g--; ) {
+      diff = pix[*ip++];
+      diff <<= *ip++;
+      sum[*ip++] += diff;
+    }
+    for (g=dc->colors; --g; ) {
+      c = *ip++;
+      pix[c] = sum[c] / *ip++;
+    }
+    pix += 4;
+  }
+}
+
+/*
+   Interpolate whole rows bilinearly, one color and column parity at
+   a time.  The neighbors are summed into acc[], and each sum, less
+   than 2^20, is divided by a weight of at most 16 with a reciprocal
+   multiply, which is exact in that range.
+ */
+static void bilinear_band (struct dcraw *dc, void *arg, int band, int top,
+	int bottom)
+{
+  struct vng *vp = arg;
+  ushort *pix;
+  unsigned *acc;
+  int *ip, *op, row, phase, n, g, c, j, off, sh;
+  INT64 mul;
+
+  acc = malloc (dc->width/2 * sizeof *acc);
+  merror (acc, "bilinear_band()");
+  for (row=top; row < bottom && !dc->cancelled; row++)
+    for (phase=0; phase < 2; phase++) {
+      ip = vp->lin[row & 7][(1+phase) & 1];
+      pix = dc->image[row*dc->width + 1+phase];
+      n = (dc->width-1-phase) / 2;
+      for (op=ip+24; op < ip+24 + (dc->colors-1)*2; op+=2) {
+	c = op[0];
+	memset (acc, 0, n * sizeof *acc);
+	for (g=0; g < 8; g++) {
+	  if (ip[g*3+2] != c) continue;
+	  off = ip[g*3];
+	  sh  = ip[g*3+1];
+	  for (j=0; j < n; j++)
+	    acc[j] += pix[off + j*8] << sh;
+	}
+	mul = ((INT64) 1 << 32) / op[1] + 1;
+	for (j=0; j < n; j++)
+	  pix[j*8 + c] = acc[j] * mul >> 32;
+      }
+    }
+  free (acc);
+}
+
+/*
+   The same for the 2x2 Bayer patterns, where every weight comes down
+   to the average of two or four neighbors.
+ */
+static void bilinear_bayer_band (struct dcraw *dc, void *arg, int band, int top,
+	int bottom)
+{
+  ushort (*pix)[4], (*end)[4];
+  int w=dc->width, row, col, c, d;
+
+  for (row=top; row < bottom && !dc->cancelled; row++)
+    for (col=1; col < 3; col++) {
+      pix = dc->image + row*w + col;
+      end = dc->image + row*w + w-1;
+      if ((c = FC(row,col)) == 1) {		/* Green pixel */
+	c = FC(row,col+1);
+	d = 2 - c;
+	for ( ; pix < end; pix+=2) {
+	  pix[0][c] = (pix[-1][c] + pix[1][c]) >> 1;
+	  pix[0][d] = (pix[-w][d] + pix[w][d]) >> 1;
+	}
+      } else {					/* Red or blue pixel */
+	d = 2 - c;
+	for ( ; pix < end; pix+=2) {
+	  pix[0][1] = (pix[-1][1] + pix[1][1] + pix[-w][1] + pix[w][1]) >> 2;
+	  pix[0][d] = (pix[-w-1][d] + pix[-w+1][d]
+		     + pix[ w-1][d] + pix[ w+1][d]) >> 2;
+	}
+      }
+    }
+}
+
+static void vng_plane_band (struct dcraw *dc, void *arg, int band, int top,
+	int bottom)
+{
+  struct vng *vp = arg;
+  struct vng_win win, *wp = &win;
+  int tile, row, n, c;
+
+  tile = cache_size() / 2 / 72 & -2;	/* about 72 bytes per column */
+  if (tile < 32) tile = 32;
+  win.half = n = tile/2 + 4;
+  win.plane = malloc (5 * 4 * 2 * n * sizeof *win.plane);
+  win.gval = malloc (15 * n * sizeof *win.gval);
+  merror (win.plane, "vng_interpolate()");
+  merror (win.gval, "vng_interpolate()");
+  win.sum = win.gval + 8*n;
+  win.thold = win.sum + 4*n;
+  win.num = win.thold + n;
+  win.diff = win.num + n;
+  for (win.left=2; win.left < dc->width-2; win.left += tile) {
+    if ((win.right = win.left + tile) > dc->width-2)
+      win.right = dc->width-2;
+    win.base = win.left - 4;
+    for (row=top-2; row < top+2; row++)
+      vng_win_row (dc, vp, wp, row);
+    for (row=top; row < bottom && !dc->cancelled; row++) {
+      vng_win_row (dc, vp, wp, row+2);
+      vng_plane_row (dc, vp, wp, row, dc->image + row*dc->width);
+      for (c=0; c < dc->colors; c++) {	/* Bilinear at the edges */
+	if (win.left == 2 && c != FC(row,1))
+	  dc->image[row*dc->width+1][c] = PLANE(row,c,1)[(1 - win.base) >> 1];
+	if (win.right == dc->width-2 && c != FC(row,dc->width-2))
+	  dc->image[row*dc->width+dc->width-2][c] =
+		PLANE(row,c,dc->width & 1)[(dc->width-2 - win.base) >> 1];
+      }
+    }
+  }
+  free (win.plane);
+  free (win.gval);
+}
+
+/*
+   Return nonzero for the 2x2 Bayer patterns with their own kernels.
+ */
+static int bayer_pattern(struct dcraw *dc)
+{
+  return dc->colors == 3 &&
+	(dc->filters == 0x94949494 || dc->filters == 0x61616161 ||
+	 dc->filters == 0x16161616 || dc->filters == 0x49494949);
+}
+
+/*
+   Edge-directed interpolation for the 2x2 Bayer patterns, after
+   Hamilton and Adams.  Green is interpolated along the row or the
+   column, whichever is smoother, and corrected by the second
+   difference of the raw color there.  Red and blue are then filled
+   in as differences from green.  Each pass reads only raw samples
+   and what the pass before it wrote, so both run in bands with no
+   overlap.  Every loop steps over one color, two columns at a time.
+   The border is done bilinearly.
+ */
+#define CLIP16(x) ((x) > 0 ? ((x) < 0xffff ? (x) : 0xffff) : 0)
+
+static void edge_green_band (struct dcraw *dc, void *arg, int band, int top,
+	int bottom)
+{
+  ushort (*pix)[4];
+  int w=dc->width, row, col, c, lh, lv, dh, dv, gh, gv, g;
+
+  for (row=top; row < bottom && !dc->cancelled; row++) {
+    if (row < 2 || row > dc->height-3) {
+      bilinear_row (dc, arg, row, 1, dc->width-1);
+      continue;
+    }
+    bilinear_row (dc, arg, row, 1, 2);
+    bilinear_row (dc, arg, row, dc->width-2, dc->width-1);
+    col = 2 + (FC(row,2) == 1);
+    c = FC(row,col);
+    for (pix = dc->image + row*w + col; col < w-2; col+=2, pix+=2) {
+      lh = pix[0][c]*2 - pix[-2][c] - pix[2][c];
+      lv = pix[0][c]*2 - pix[-2*w][c] - pix[2*w][c];
+      dh = abs(pix[-1][1] - pix[1][1]) + abs(lh);
+      dv = abs(pix[-w][1] - pix[w][1]) + abs(lv);
+      gh = (pix[-1][1] + pix[1][1])*2 + lh;
+      gv = (pix[-w][1] + pix[w][1])*2 + lv;
+      g = (dh < dv ? gh : dv < dh ? gv : (gh + gv) >> 1) >> 2;
+      pix[0][1] = CLIP16(g);
+    }
+  }
+}
+
+static void edge_rb_band (struct dcraw *dc, void *arg, int band, int top,
+	int bottom)
+{
+  ushort (*pix)[4];
+  int w=dc->width, row, col, c, d, t;
+
+  for (row=top; row < bottom && !dc->cancelled; row++)
+    for (col=2; col < 4; col++) {
+      pix = dc->image + row*w + col;
+      if ((c = FC(row,col)) == 1) {		/* Green pixel */
+	c = FC(row,col+1);
+	d = 2 - c;
+	for ( ; pix < dc->image + row*w + w-2; pix+=2) {
+	  t = pix[0][1] + (pix[-1][c] - pix[-1][1]
+			 + pix[ 1][c] - pix[ 1][1]) / 2;
+	  pix[0][c] = CLIP16(t);
+	  t = pix[0][1] + (pix[-w][d] - pix[-w][1]
+			 + pix[ w][d] - pix[ w][1]) / 2;
+	  pix[0][d] = CLIP16(t);
+	}
+      } else {					/* Red or blue pixel */
+	d = 2 - c;
+	for ( ; pix < dc->image + row*w + w-2; pix+=2) {
+	  t = pix[0][1] + (pix[-w-1][d] - pix[-w-1][1]
+			 + pix[-w+1][d] - pix[-w+1][1]
+			 + pix[ w-1][d] - pix[ w-1][1]
+			 + pix[ w+1][d] - pix[ w+1][1]) / 4;
+	  pix[0][d] = CLIP16(t);
+	}
+      }
+    }
+}
+
+/*
+   Adaptive Homogeneity-Directed interpolation for the 2x2 Bayer
+   patterns, as described in
+
+   K. Hirakawa and T. W. Parks, "Adaptive Homogeneity-Directed
+   Demosaicing Algorithm", IEEE Trans. Image Processing, March 2005.
+
+   Each pixel is interpolated twice, with green taken along the row
+   and along the column.  Both results are converted to CIELab, and
+   whichever is more uniform around the pixel wins.  The work is done
+   in tiles small enough to stay in cache, each band of rows doing
+   its own tiles, so only raw samples are read from the image.  The
+   five-pixel border is done bilinearly.
+ */
+#define TS 128		/* Tile size, with six pixels of overlap */
+#define LIM(x,lo,hi) MAX(lo,MIN(x,hi))
+#define ULIM(x,a,b) ((a) < (b) ? LIM(x,a,b) : LIM(x,b,a))
+
+struct ahd {
+  struct vng *vp;
+  float cbrt[0x10000], xyz_cam[3][3];
+};
+
+/*
+   Convert n pixels to CIELab, times 64.  The matrix is applied to all
+   of them before the table lookups, so that loop can be vectorized.
  */
-void vng_interpolate()
+static void ahd_cielab (struct ahd *ap, ushort (*rgb)[3], short (*lab)[3],
+	int n)
+{
+  int xyz[3][TS], i, c;
+  float *m, v, f[3];
+
+  for (c=0; c < 3; c++) {
+    m = ap->xyz_cam[c];
+    for (i=0; i < n; i++) {
+      v = 0.5 + m[0]*rgb[i][0] + m[1]*rgb[i][1] + m[2]*rgb[i][2];
+      xyz[c][i] = v < 0xffff ? v : 0xffff;
+    }
+  }
+  for (i=0; i < n; i++) {
+    for (c=0; c < 3; c++)
+      f[c] = ap->cbrt[xyz[c][i]];
+    lab[i][0] = 64 * (116 * f[1] - 16);
+    lab[i][1] = 64 * 500 * (f[0] - f[1]);
+    lab[i][2] = 64 * 200 * (f[1] - f[2]);
+  }
+}
+
+static void ahd_band (struct dcraw *dc, void *arg, int band, int top,
+	int bottom)
+{
+  static const int dir[4] = { -1, 1, -TS, TS };
+  struct ahd *ap = arg;
+  ushort (*rgb)[TS][TS][3], (*rix)[3], (*pix)[4];
+  short (*lab)[TS][TS][3], (*lix)[3];
+  char (*homo)[TS][TS], *buffer;
+  unsigned ldiff[2][4], abdiff[2][4], leps, abeps;
+  int row, col, ttop, left, tr, tc, i, j, c, d, val, hm[2];
+
+  for (row=top; row < bottom; row++)		/* Bilinear at the border */
+    if (row < 5 || row > dc->height-6)
+      bilinear_row (dc, ap->vp, row, 1, dc->width-1);
+    else {
+      bilinear_row (dc, ap->vp, row, 1, 5);
+      bilinear_row (dc, ap->vp, row, dc->width-5, dc->width-1);
+    }
+  if (top < 5) top = 5;
+  if (bottom > dc->height-5) bottom = dc->height-5;
+  buffer = malloc (26*TS*TS);
+  merror (buffer, "ahd_interpolate()");
+  rgb  = (ushort (*)[TS][TS][3]) buffer;
+  lab  = (short  (*)[TS][TS][3]) (buffer + 12*TS*TS);
+  homo = (char   (*)[TS][TS])    (buffer + 24*TS*TS);
+
+  for (ttop=top-3; ttop < bottom-3 && !dc->cancelled; ttop += TS-6)
+    for (left=2; left < dc->width-5; left += TS-6) {
+
+/*  Interpolate green horizontally and vertically:		*/
+      for (row=ttop; row < ttop+TS && row < dc->height-2; row++) {
+	col = left + (FC(row,left) == 1);
+	c = FC(row,col);
+	for ( ; col < left+TS && col < dc->width-2; col+=2) {
+	  pix = dc->image + row*dc->width + col;
+	  val = ((pix[-1][1] + pix[0][c] + pix[1][1]) * 2
+		- pix[-2][c] - pix[2][c]) >> 2;
+	  rgb[0][row-ttop][col-left][1] = ULIM(val,pix[-1][1],pix[1][1]);
+	  val = ((pix[-dc->width][1] + pix[0][c] + pix[dc->width][1]) * 2
+		- pix[-2*dc->width][c] - pix[2*dc->width][c]) >> 2;
+	  rgb[1][row-ttop][col-left][1] =
+		ULIM(val,pix[-dc->width][1],pix[dc->width][1]);
+	}
+      }
+/*  Interpolate red and blue, and convert to CIELab:		*/
+      for (d=0; d < 2; d++)
+	for (row=ttop+1; row < ttop+TS-1 && row < dc->height-3; row++) {
+	  for (col=left+1; col < left+TS-1 && col < dc->width-3; col++) {
+	    pix = dc->image + row*dc->width + col;
+	    rix = &rgb[d][row-ttop][col-left];
+	    if ((c = 2 - FC(row,col)) == 1) {
+	      c = FC(row+1,col);
+	      val = pix[0][1] + (( pix[-1][2-c] + pix[1][2-c]
+				 - rix[-1][1] - rix[1][1] ) >> 1);
+	      rix[0][2-c] = CLIP16(val);
+	      val = pix[0][1] + (( pix[-dc->width][c] + pix[dc->width][c]
+				 - rix[-TS][1] - rix[TS][1] ) >> 1);
+	    } else
+	      val = rix[0][1] + (( pix[-dc->width-1][c] + pix[-dc->width+1][c]
+				 + pix[+dc->width-1][c] + pix[+dc->width+1][c]
+				 - rix[-TS-1][1] - rix[-TS+1][1]
+				 - rix[+TS-1][1] - rix[+TS+1][1] + 1) >> 2);
+	    rix[0][c] = CLIP16(val);
+	    c = FC(row,col);
+	    rix[0][c] = pix[0][c];
+	  }
+	  ahd_cielab (ap, rgb[d][row-ttop]+1, lab[d][row-ttop]+1,
+		col - left - 1);
+	}
+/*  Build homogeneity maps from the CIELab images:		*/
+      memset (homo, 0, 2*TS*TS);
+      for (row=ttop+2; row < ttop+TS-2 && row < dc->height-4; row++) {
+	tr = row-ttop;
+	for (col=left+2; col < left+TS-2 && col < dc->width-4; col++) {
+	  tc = col-left;
+	  for (d=0; d < 2; d++) {
+	    lix = &lab[d][tr][tc];
+	    for (i=0; i < 4; i++) {
+	       ldiff[d][i] = abs(lix[0][0]-lix[dir[i]][0]);
+	      abdiff[d][i] = (lix[0][1]-lix[dir[i]][1])
+			   * (lix[0][1]-lix[dir[i]][1])
+			   + (lix[0][2]-lix[dir[i]][2])
+			   * (lix[0][2]-lix[dir[i]][2]);
+	    }
+	  }
+	  leps = MIN(MAX(ldiff[0][0],ldiff[0][1]),
+		     MAX(ldiff[1][2],ldiff[1][3]));
+	  abeps = MIN(MAX(abdiff[0][0],abdiff[0][1]),
+		      MAX(abdiff[1][2],abdiff[1][3]));
+	  for (d=0; d < 2; d++)
+	    for (i=0; i < 4; i++)
+	      if (ldiff[d][i] <= leps && abdiff[d][i] <= abeps)
+		homo[d][tr][tc]++;
+	}
+      }
+/*  Combine the most homogenous pixels for the final result:	*/
+      for (row=ttop+3; row < ttop+TS-3 && row < bottom; row++) {
+	tr = row-ttop;
+	for (col=left+3; col < left+TS-3 && col < dc->width-5; col++) {
+	  tc = col-left;
+	  for (d=0; d < 2; d++)
+	    for (hm[d]=0, i=tr-1; i <= tr+1; i++)
+	      for (j=tc-1; j <= tc+1; j++)
+		hm[d] += homo[d][i][j];
+	  d = FC(row,col);
+	  for (c=0; c < 3; c++) {
+	    if (c == d) continue;
+	    dc->image[row*dc->width+col][c] = hm[0] != hm[1] ?
+		rgb[hm[1] > hm[0]][tr][tc][c] :
+		(rgb[0][tr][tc][c] + rgb[1][tr][tc][c]) >> 1;
+	  }
+	}
+      }
+    }
+  free (buffer);
+}
+
+static void ahd_interpolate (struct dcraw *dc, struct vng *vp)
+{
+  static const float xyz_rgb[3][3] = {		/* XYZ from sRGB */
+    { 0.412453, 0.357580, 0.180423 },
+    { 0.212671, 0.715160, 0.072169 },
+    { 0.019334, 0.119193, 0.950227 } },
+  d65_white[3] = { 0.950456, 1, 1.088754 };
+  struct ahd *ap;
+  float r;
+  int i, c;
+
+  ap = malloc (sizeof *ap);
+  merror (ap, "ahd_interpolate()");
+  ap->vp = vp;
+  for (i=0; i < 0x10000; i++) {
+    r = (float) i / dc->rgb_max;
+    ap->cbrt[i] = r > 0.008856 ? pow(r,1/3.0) : 7.787*r + 16/116.0;
+  }
+  for (i=0; i < 3; i++)
+    for (c=0; c < 3; c++)
+      ap->xyz_cam[i][c] = xyz_rgb[i][c] / d65_white[i];
+  run_bands (dc, ahd_band, ap, 1, dc->height-1);
+  free (ap);
+}
+
+static void vng_interpolate(struct dcraw *dc)
 {
-  static const signed char *cp, terms[] = {
+  static const signed char terms[] = {
     -2,-2,+0,-1,0,0x01, -2,-2,+0,+0,1,0x01, -2,-1,-1,+0,0,0x01,
     -2,-1,+0,-1,0,0x02, -2,-1,+0,+0,0,0x03, -2,-1,+0,+1,0,0x01,
     -2,+0,+0,-1,0,0x06, -2,+0,+0,+0,1,0x02, -2,+0,+0,+1,0,0x03,
@@ -1585,55 +3020,52 @@ void vng_interpolate()
     +1,-1,+1,+1,0,0x88, +1,+0,+1,+2,0,0x08, +1,+0,+2,-1,0,0x40,
     +1,+0,+2,+1,0,0x10
   }, chood[] = { -1,-1, -1,0, -1,+1, 0,+1, +1,+1, +1,0, +1,-1, 0,-1 };
-  ushort (*brow[5])[4], *pix;
-  int code[8][640], *ip, gval[8], gmin, gmax, sum[4];
+  const signed char *cp;
+  struct vng vng;
+  struct vng_phase *ph;
+  int lin[8][2][32], *ip, *tp, sum[4];
   int row, col, shift, x, y, x1, x2, y1, y2, t, weight, grads, color, diag;
-  int g, diff, thold, num, c;
+  int g, c;
 
-  for (row=0; row < 8; row++) {		/* Precalculate for bilinear */
-    ip = code[row];
+  for (row=0; row < 8; row++)		/* Precalculate for bilinear */
     for (col=1; col < 3; col++) {
+      ip = lin[row][col & 1];
       memset (sum, 0, sizeof sum);
       for (y=-1; y <= 1; y++)
 	for (x=-1; x <= 1; x++) {
 	  shift = (y==0) + (x==0);
 	  if (shift == 2) continue;
 	  color = FC(row+y,col+x);
-	  *ip++ = (width*y + x)*4 + color;
+	  *ip++ = (dc->width*y + x)*4 + color;
 	  *ip++ = shift;
 	  *ip++ = color;
 	  sum[color] += 1 << shift;
 	}
-      for (c=0; c < colors; c++)
+      for (c=0; c < dc->colors; c++)
 	if (c != FC(row,col)) {
 	  *ip++ = c;
 	  *ip++ = sum[c];
 	}
     }
+  vng.lin = lin;
+  if (dc->quick_interpolate) {		/* Do bilinear interpolation */
+    run_bands (dc, bayer_pattern(dc) ? bilinear_bayer_band : bilinear_band,
+	&vng, 1, dc->height-1);
+    return;
   }
-  for (row=1; row < height-1; row++) {	/* Do bilinear interpolation */
-    pix = image[row*width+1];
-    for (col=1; col < width-1; col++) {
-      if (col & 1)
-	ip = code[row & 7];
-      memset (sum, 0, sizeof sum);
-      for (g=8; g--; ) {
-	diff = pix[*ip++];
-	diff <<= *ip++;
-	sum[*ip++] += diff;
-      }
-      for (g=colors; --g; ) {
-	c = *ip++;
-	pix[c] = sum[c] / *ip++;
-      }
-      pix += 4;
-    }
+  if (bayer_pattern(dc) && dc->use_ahd) {	/* Do AHD interpolation */
+    ahd_interpolate (dc, &vng);
+    return;
   }
-  if (quick_interpolate)
+  if (bayer_pattern(dc) && dc->edge_interpolate) {	/* Do edge-directed */
+    run_bands (dc, edge_green_band, &vng, 1, dc->height-1);
+    run_bands (dc, edge_rb_band, &vng, 2, dc->height-2);
     return;
-  for (row=0; row < 8; row++) {		/* Precalculate for VNG */
-    ip = code[row];
+  }
+  for (row=0; row < 8; row++)		/* Precalculate for VNG */
     for (col=0; col < 2; col++) {
+      ph = &vng.phase[row][col];
+      ph->nterm = 0;
       for (cp=terms, t=0; t < 64; t++) {
 	y1 = *cp++;  x1 = *cp++;
 	y2 = *cp++;  x2 = *cp++;
@@ -1643,88 +3075,39 @@ void vng_interpolate()
 	if (FC(row+y2,col+x2) != color) continue;
 	diag = (FC(row,col+1) == color && FC(row+1,col) == color) ? 2:1;
 	if (abs(y1-y2) == diag && abs(x1-x2) == diag) continue;
-	*ip++ = (y1*width + x1)*4 + color;
-	*ip++ = (y2*width + x2)*4 + color;
-	*ip++ = weight;
-	for (g=0; g < 8; g++)
-	  if (grads & 1<<g) *ip++ = g;
-	*ip++ = -1;
+	tp = ph->term[ph->nterm++];
+	tp[0] = y1;  tp[1] = x1;
+	tp[2] = y2;  tp[3] = x2;
+	tp[4] = color;
+	tp[5] = weight;
+	for (tp[6]=g=0; g < 8; g++)
+	  if (grads & 1<<g) tp[7 + tp[6]++] = g;
       }
-      *ip++ = INT_MAX;
       for (cp=chood, g=0; g < 8; g++) {
 	y = *cp++;  x = *cp++;
-	*ip++ = (y*width + x) * 4;
+	ph->chood[g][0] = y;
+	ph->chood[g][1] = x;
 	color = FC(row,col);
-	if ((g & 1) == 0 &&
-	    FC(row+y,col+x) != color && FC(row+y*2,col+x*2) == color)
-	  *ip++ = (y*width + x) * 8 + color;
-	else
-	  *ip++ = 0;
-      }
-    }
-  }
-  brow[4] = calloc (width*3, sizeof **brow);
-  merror (brow[4], "vng_interpolate()");
-  for (row=0; row < 3; row++)
-    brow[row] = brow[4] + row*width;
-  for (row=2; row < height-2; row++) {		/* Do VNG interpolation */
-    pix = image[row*width+2];
-    for (col=2; col < width-2; col++) {
-      if ((col & 1) == 0)
-	ip = code[row & 7];
-      memset (gval, 0, sizeof gval);
-      while ((g = *ip++) != INT_MAX) {		/* Calculate gradients */
-	diff = abs(pix[g] - pix[*ip++]);
-	diff <<= *ip++;
-	while ((g = *ip++) != -1)
-	  gval[g] += diff;
-      }
-      gmin = INT_MAX;				/* Choose a threshold */
-      gmax = 0;
-      for (g=0; g < 8; g++) {
-	if (gmin > gval[g]) gmin = gval[g];
-	if (gmax < gval[g]) gmax = gval[g];
-      }
-      thold = gmin + (gmax >> 1);
-      memset (sum, 0, sizeof sum);
-      color = FC(row,col);
-      for (num=g=0; g < 8; g++,ip+=2) {		/* Average the neighbors */
-	if (gval[g] <= thold) {
-	  for (c=0; c < colors; c++)
-	    if (c == color && ip[1])
-	      sum[c] += (pix[c] + pix[ip[1]]) >> 1;
-	    else
-	      sum[c] += pix[ip[0] + c];
-	  num++;
-	}
-      }
-      for (c=0; c < colors; c++) {		/* Save to buffer */
-	t = pix[color] + (sum[c] - sum[color])/num;
-	brow[2][col][c] = t > 0 ? (t < 0xffff ? t : 0xffff) : 0;
+	ph->chood[g][2] = (g & 1) == 0 &&
+	    FC(row+y,col+x) != color && FC(row+y*2,col+x*2) == color;
       }
-      pix += 4;
     }
-    if (row > 3)				/* Write buffer to image */
-      memcpy (image[(row-2)*width+2], brow[0]+2, (width-4)*sizeof *image);
-    for (g=0; g < 4; g++)
-      brow[(g-1) & 3] = brow[g];
-  }
-  memcpy (image[(row-2)*width+2], brow[0]+2, (width-4)*sizeof *image);
-  memcpy (image[(row-1)*width+2], brow[1]+2, (width-4)*sizeof *image);
-  free(brow[4]);
+  run_bands (dc, vng_plane_band, &vng, 2, dc->height-2);	/* Do VNG interpolation */
+  bilinear_band (dc, &vng, 0, 1, 2);
+  bilinear_band (dc, &vng, 0, dc->height-2, dc->height-1);
 }
 
 /*
    Get a 2-byte integer, making no assumptions about CPU byte order.
    Nor should we assume that the compiler evaluates left-to-right.
  */
-ushort fget2 (FILE *f)
+static ushort fget2 (struct dcraw *dc, FILE *f)
 {
   uchar a, b;
 
   a = fgetc(f);
   b = fgetc(f);
-  if (order == 0x4949)		/* "II" means little-endian */
+  if (dc->order == 0x4949)		/* "II" means little-endian */
     return a + (b << 8);
   else				/* "MM" means big-endian */
     return (a << 8) + b;
@@ -1733,7 +3116,7 @@ ushort fget2 (FILE *f)
 /*
    Same for a 4-byte integer.
  */
-int fget4 (FILE *f)
+static int fget4 (struct dcraw *dc, FILE *f)
 {
   uchar a, b, c, d;
 
@@ -1741,48 +3124,59 @@ int fget4 (FILE *f)
   b = fgetc(f);
   c = fgetc(f);
   d = fgetc(f);
-  if (order == 0x4949)
+  if (dc->order == 0x4949)
     return a + (b << 8) + (c << 16) + (d << 24);
   else
     return (a << 24) + (b << 16) + (c << 8) + d;
 }
 
-void tiff_parse_subifd(int base)
+/*
+   Remember the largest embedded JPEG preview seen so far.
+ */
+static void save_thumb (struct dcraw *dc, int offset, int length)
 {
-  int entries, tag, type, len, val, save;
+  if (length > dc->thumb_length) {
+    dc->thumb_offset = offset;
+    dc->thumb_length = length;
+  }
+}
+
+static void tiff_parse_subifd(struct dcraw *dc, int base)
+{
+  int entries, tag, type, len, val, save, toff=0, tlen=0;
 
-  entries = fget2(ifp);
+  entries = fget2(dc, dc->ifp);
   while (entries--) {
-    tag  = fget2(ifp);
-    type = fget2(ifp);
-    len  = fget4(ifp);
+    tag  = fget2(dc, dc->ifp);
+    type = fget2(dc, dc->ifp);
+    len  = fget4(dc, dc->ifp);
     if (type == 3) {		/* short int */
-      val = fget2(ifp);  fget2(ifp);
+      val = fget2(dc, dc->ifp);  fget2(dc, dc->ifp);
     } else
-      val = fget4(ifp);
+      val = fget4(dc, dc->ifp);
     switch (tag) {
       case 0x100:		/* ImageWidth */
-	raw_width = val;
+	dc->raw_width = val;
 	break;
       case 0x101:		/* ImageHeight */
-	raw_height = val;
+	dc->raw_height = val;
 	break;
       case 0x102:		/* Bits per sample */
 	break;
       case 0x103:		/* Compression */
-	tiff_data_compression = val;
+	dc->tiff_data_compression = val;
 	break;
       case 0x106:		/* Kodak color format */
-	kodak_data_compression = val;
+	dc->kodak_data_compression = val;
 	break;
       case 0x111:		/* StripOffset */
 	if (len == 1)
-	  tiff_data_offset = val;
+	  dc->tiff_data_offset = val;
 	else {
-	  save = ftell(ifp);
-	  fseek (ifp, val+base, SEEK_SET);
-	  tiff_data_offset = fget4(ifp);
-	  fseek (ifp, save, SEEK_SET);
+	  save = ftell(dc->ifp);
+	  fseek (dc->ifp, val+base, SEEK_SET);
+	  dc->tiff_data_offset = fget4(dc, dc->ifp);
+	  fseek (dc->ifp, save, SEEK_SET);
 	}
 	break;
       case 0x115:		/* SamplesPerRow */
@@ -1791,15 +3185,22 @@ void tiff_parse_subifd(int base)
 	break;
       case 0x117:		/* StripByteCounts */
 	break;
+      case 0x201:		/* JPEGInterchangeFormat */
+	toff = val;
+	break;
+      case 0x202:		/* JPEGInterchangeFormatLength */
+	tlen = val;
+	break;
       case 0x828d:		/* Unknown */
       case 0x828e:		/* Unknown */
       case 0x9217:		/* Unknown */
 	break;
     }
   }
+  save_thumb (dc, toff+base, tlen);
 }
 
-void nef_parse_makernote()
+static void nef_parse_makernote(struct dcraw *dc)
 {
   int base=0, offset=0, entries, tag, type, len, val, save;
   short sorder;
@@ -1809,55 +3210,55 @@ void nef_parse_makernote()
    The MakerNote might have its own TIFF header (possibly with
    its own byte-order!), or it might just be a table.
  */
-  sorder = order;
-  fread (buf, 1, 10, ifp);
+  sorder = dc->order;
+  fread (buf, 1, 10, dc->ifp);
   if (!strcmp (buf,"Nikon")) {	/* starts with "Nikon\0\2\0\0\0" ? */
-    base = ftell(ifp);
-    order = fget2(ifp);		/* might differ from file-wide byteorder */
-    val = fget2(ifp);		/* should be 42 decimal */
-    offset = fget4(ifp);
-    fseek (ifp, offset-8, SEEK_CUR);
+    base = ftell(dc->ifp);
+    dc->order = fget2(dc, dc->ifp);  /* might differ from file-wide byteorder */
+    val = fget2(dc, dc->ifp);		/* should be 42 decimal */
+    offset = fget4(dc, dc->ifp);
+    fseek (dc->ifp, offset-8, SEEK_CUR);
   } else
-    fseek (ifp, -10, SEEK_CUR);
+    fseek (dc->ifp, -10, SEEK_CUR);
 
-  entries = fget2(ifp);
+  entries = fget2(dc, dc->ifp);
   while (entries--) {
-    tag  = fget2(ifp);
-    type = fget2(ifp);
-    len  = fget4(ifp);
-    val  = fget4(ifp);
+    tag  = fget2(dc, dc->ifp);
+    type = fget2(dc, dc->ifp);
+    len  = fget4(dc, dc->ifp);
+    val  = fget4(dc, dc->ifp);
     if (tag == 0xc) {
-      save = ftell(ifp);
-      fseek (ifp, base + val, SEEK_SET);
-      camera_red  = fget4(ifp);
-      camera_red /= fget4(ifp);
-      camera_blue = fget4(ifp);
-      camera_blue/= fget4(ifp);
-      fseek (ifp, save, SEEK_SET);
+      save = ftell(dc->ifp);
+      fseek (dc->ifp, base + val, SEEK_SET);
+      dc->camera_red  = fget4(dc, dc->ifp);
+      dc->camera_red /= fget4(dc, dc->ifp);
+      dc->camera_blue = fget4(dc, dc->ifp);
+      dc->camera_blue/= fget4(dc, dc->ifp);
+      fseek (dc->ifp, save, SEEK_SET);
     }
     if (tag == 0x8c)
-      nef_curve_offset = base + val + 2112;
+      dc->nef_curve_offset = base + val + 2112;
     if (tag == 0x96)
-      nef_curve_offset = base + val + 2;
+      dc->nef_curve_offset = base + val + 2;
   }
-  order = sorder;
+  dc->order = sorder;
 }
 
-void nef_parse_exif()
+static void nef_parse_exif(struct dcraw *dc)
 {
   int entries, tag, type, len, val, save;
 
-  entries = fget2(ifp);
+  entries = fget2(dc, dc->ifp);
   while (entries--) {
-    tag  = fget2(ifp);
-    type = fget2(ifp);
-    len  = fget4(ifp);
-    val  = fget4(ifp);
-    save = ftell(ifp);
-    if (tag == 0x927c && !strncmp(make,"NIKON",5)) {
-      fseek (ifp, val, SEEK_SET);
-      nef_parse_makernote();
-      fseek (ifp, save, SEEK_SET);
+    tag  = fget2(dc, dc->ifp);
+    type = fget2(dc, dc->ifp);
+    len  = fget4(dc, dc->ifp);
+    val  = fget4(dc, dc->ifp);
+    save = ftell(dc->ifp);
+    if (tag == 0x927c && !strncmp(dc->make,"NIKON",5)) {
+      fseek (dc->ifp, val, SEEK_SET);
+      nef_parse_makernote(dc);
+      fseek (dc->ifp, save, SEEK_SET);
     }
   }
 }
@@ -1865,195 +3266,241 @@ void nef_parse_exif()
 /*
    Parse a TIFF file looking for camera model and decompress offsets.
  */
-void parse_tiff(int base)
+static void parse_tiff(struct dcraw *dc, int base)
 {
-  int doff, entries, tag, type, len, val, save;
+  int doff, entries, tag, type, len, val, save, toff, tlen;
   char software[64];
 
-  tiff_data_offset = 0;
-  tiff_data_compression = 0;
-  nef_curve_offset = 0;
-  fseek (ifp, base, SEEK_SET);
-  order = fget2(ifp);
-  val = fget2(ifp);		/* Should be 42 for standard TIFF */
-  while ((doff = fget4(ifp))) {
-    fseek (ifp, doff+base, SEEK_SET);
-    entries = fget2(ifp);
+  dc->tiff_data_offset = 0;
+  dc->tiff_data_compression = 0;
+  dc->nef_curve_offset = 0;
+  fseek (dc->ifp, base, SEEK_SET);
+  dc->order = fget2(dc, dc->ifp);
+  val = fget2(dc, dc->ifp);		/* Should be 42 for standard TIFF */
+  while ((doff = fget4(dc, dc->ifp))) {
+    fseek (dc->ifp, doff+base, SEEK_SET);
+    entries = fget2(dc, dc->ifp);
+    toff = tlen = 0;
     while (entries--) {
-      tag  = fget2(ifp);
-      type = fget2(ifp);
-      len  = fget4(ifp);
-      val  = fget4(ifp);
-      save = ftell(ifp);
-      fseek (ifp, val+base, SEEK_SET);
+      tag  = fget2(dc, dc->ifp);
+      type = fget2(dc, dc->ifp);
+      len  = fget4(dc, dc->ifp);
+      val  = fget4(dc, dc->ifp);
+      save = ftell(dc->ifp);
+      fseek (dc->ifp, val+base, SEEK_SET);
       switch (tag) {
 	case 271:			/* Make tag */
-	  fgets (make, 64, ifp);
+	  fgets (dc->make, 64, dc->ifp);
 	  break;
 	case 272:			/* Model tag */
-	  fgets (model, 64, ifp);
+	  fgets (dc->model, 64, dc->ifp);
 	  break;
 	case 33405:			/* Model2 tag */
-	  fgets (model2, 64, ifp);
+	  fgets (dc->model2, 64, dc->ifp);
 	  break;
 	case 305:			/* Software tag */
-	  fgets (software, 64, ifp);
+	  fgets (software, 64, dc->ifp);
 	  if (!strncmp(software,"Adobe",5))
-	    model[0] = 0;
+	    dc->model[0] = 0;
 	  break;
 	case 330:			/* SubIFD tag */
 	  if (len > 2) len=2;
 	  if (len > 1)
 	    while (len--) {
-	      fseek (ifp, val+base, SEEK_SET);
-	      fseek (ifp, fget4(ifp)+base, SEEK_SET);
-	      tiff_parse_subifd(base);
+	      fseek (dc->ifp, val+base, SEEK_SET);
+	      fseek (dc->ifp, fget4(dc, dc->ifp)+base, SEEK_SET);
+	      tiff_parse_subifd(dc, base);
 	      val += 4;
 	    }
 	  else
-	    tiff_parse_subifd(base);
+	    tiff_parse_subifd(dc, base);
 	  break;
 	case 0x8769:			/* Nikon EXIF tag */
-	  nef_parse_exif();
+	  nef_parse_exif(dc);
+	  break;
+	case 0x201:			/* JPEGInterchangeFormat */
+	  toff = val;
+	  break;
+	case 0x202:			/* JPEGInterchangeFormatLength */
+	  tlen = val;
 	  break;
       }
-      fseek (ifp, save, SEEK_SET);
+      fseek (dc->ifp, save, SEEK_SET);
     }
+    save_thumb (dc, toff+base, tlen);
   }
 }
 
 /*
    Parse the CIFF structure looking for two pieces of information:
-   The camera model, and the decode table number.
+   The camera model, and the decode table number.  Also note where
+   the embedded JPEG preview and thumbnail are stored.
  */
-void parse_ciff(int offset, int length)
+static void parse_ciff(struct dcraw *dc, int offset, int length)
 {
   int tboff, nrecs, i, type, len, roff, aoff, save;
   int wbi=0;
 
-  fseek (ifp, offset+length-4, SEEK_SET);
-  tboff = fget4(ifp) + offset;
-  fseek (ifp, tboff, SEEK_SET);
-  nrecs = fget2(ifp);
+  fseek (dc->ifp, offset+length-4, SEEK_SET);
+  tboff = fget4(dc, dc->ifp) + offset;
+  fseek (dc->ifp, tboff, SEEK_SET);
+  nrecs = fget2(dc, dc->ifp);
   for (i = 0; i < nrecs; i++) {
-    type = fget2(ifp);
-    len  = fget4(ifp);
-    roff = fget4(ifp);
+    type = fget2(dc, dc->ifp);
+    len  = fget4(dc, dc->ifp);
+    roff = fget4(dc, dc->ifp);
     aoff = offset + roff;
-    save = ftell(ifp);
+    save = ftell(dc->ifp);
     if (type == 0x080a) {		/* Get the camera make and model */
-      fseek (ifp, aoff, SEEK_SET);
-      fread (make, 64, 1, ifp);
-      fseek (ifp, aoff+strlen(make)+1, SEEK_SET);
-      fread (model, 64, 1, ifp);
+      fseek (dc->ifp, aoff, SEEK_SET);
+      fread (dc->make, 64, 1, dc->ifp);
+      fseek (dc->ifp, aoff+strlen(dc->make)+1, SEEK_SET);
+      fread (dc->model, 64, 1, dc->ifp);
     }
     if (type == 0x102a) {		/* Find the White Balance index */
-      fseek (ifp, aoff+14, SEEK_SET);	/* 0=auto, 1=daylight, 2=cloudy ... */
-      wbi = fget2(ifp);
+      fseek (dc->ifp, aoff+14, SEEK_SET); /* 0=auto, 1=daylight, 2=cloudy ... */
+      wbi = fget2(dc, dc->ifp);
     }
     if (type == 0x102c) {		/* Get white balance (G2) */
-      fseek (ifp, aoff+100, SEEK_SET);	/* could use 100, 108 or 116 */
-      camera_red = fget2(ifp);
-      camera_red = fget2(ifp) / camera_red;
-      camera_blue  = fget2(ifp);
-      camera_blue /= fget2(ifp);
-    }
-    if (type == 0x0032 && !strcmp(model,"Canon EOS D30")) {
-      fseek (ifp, aoff+72, SEEK_SET);	/* Get white balance (D30) */
-      camera_red   = fget2(ifp);
-      camera_red   = fget2(ifp) / camera_red;
-      camera_blue  = fget2(ifp);
-      camera_blue /= fget2(ifp);
+      fseek (dc->ifp, aoff+100, SEEK_SET); /* could use 100, 108 or 116 */
+      dc->camera_red = fget2(dc, dc->ifp);
+      dc->camera_red = fget2(dc, dc->ifp) / dc->camera_red;
+      dc->camera_blue  = fget2(dc, dc->ifp);
+      dc->camera_blue /= fget2(dc, dc->ifp);
+    }
+    if (type == 0x0032 && !strcmp(dc->model,"Canon EOS D30")) {
+      fseek (dc->ifp, aoff+72, SEEK_SET);	/* Get white balance (D30) */
+      dc->camera_red   = fget2(dc, dc->ifp);
+      dc->camera_red   = fget2(dc, dc->ifp) / dc->camera_red;
+      dc->camera_blue  = fget2(dc, dc->ifp);
+      dc->camera_blue /= fget2(dc, dc->ifp);
       if (wbi==0)			/* AWB doesn't work here */
-	camera_red = camera_blue = 0;
+	dc->camera_red = dc->camera_blue = 0;
     }
     if (type == 0x10a9) {		/* Get white balance (D60) */
-      fseek (ifp, aoff+2 + wbi*8, SEEK_SET);
-      camera_red  = fget2(ifp);
-      camera_red /= fget2(ifp);
-      camera_blue = fget2(ifp);
-      camera_blue = fget2(ifp) / camera_blue;
+      fseek (dc->ifp, aoff+2 + wbi*8, SEEK_SET);
+      dc->camera_red  = fget2(dc, dc->ifp);
+      dc->camera_red /= fget2(dc, dc->ifp);
+      dc->camera_blue = fget2(dc, dc->ifp);
+      dc->camera_blue = fget2(dc, dc->ifp) / dc->camera_blue;
     }
     if (type == 0x1031) {		/* Get the raw width and height */
-      fseek (ifp, aoff+2, SEEK_SET);
-      raw_width  = fget2(ifp);
-      raw_height = fget2(ifp);
+      fseek (dc->ifp, aoff+2, SEEK_SET);
+      dc->raw_width  = fget2(dc, dc->ifp);
+      dc->raw_height = fget2(dc, dc->ifp);
     }
     if (type == 0x180e) {		/* Get the timestamp */
-      fseek (ifp, aoff, SEEK_SET);
-      timestamp = fget4(ifp);
+      fseek (dc->ifp, aoff, SEEK_SET);
+      dc->timestamp = fget4(dc, dc->ifp);
     }
     if (type == 0x1835) {		/* Get the decoder table */
-      fseek (ifp, aoff, SEEK_SET);
-      init_tables (fget4(ifp));
+      fseek (dc->ifp, aoff, SEEK_SET);
+      init_tables (dc, fget4(dc, dc->ifp));
     }
+    if (type == 0x2007 || type == 0x2008)	/* JPEG preview, thumbnail */
+      save_thumb (dc, aoff, len);
     if (type >> 8 == 0x28 || type >> 8 == 0x30)	/* Get sub-tables */
-      parse_ciff(aoff, len);
-    fseek (ifp, save, SEEK_SET);
+      parse_ciff(dc, aoff, len);
+    fseek (dc->ifp, save, SEEK_SET);
   }
 }
 
-void parse_rollei()
+static void parse_rollei(struct dcraw *dc)
 {
   char line[128], *val;
   int tx=0, ty=0;
 
   do {
-    fgets (line, 128, ifp);
+    fgets (line, 128, dc->ifp);
     if ((val = strchr(line,'=')))
       *val++ = 0;
     else
       val = line + strlen(line);
     if (!strcmp(line,"HDR"))
-      tiff_data_offset = atoi(val);
+      dc->tiff_data_offset = atoi(val);
     if (!strcmp(line,"X  "))
-      raw_width = atoi(val);
+      dc->raw_width = atoi(val);
     if (!strcmp(line,"Y  "))
-      raw_height = atoi(val);
+      dc->raw_height = atoi(val);
     if (!strcmp(line,"TX "))
       tx = atoi(val);
     if (!strcmp(line,"TY "))
       ty = atoi(val);
   } while (strncmp(line,"EOHD",4));
-  tiff_data_offset += tx * ty * 2;
-  strcpy (make, "Rollei");
-  strcpy (model, "d530flex");
-}
-
-void parse_foveon()
-{
-  char *buf, *bp, *np;
-  int off1, off2, len, i;
-
-  order = 0x4949;			/* Little-endian */
-  fseek (ifp, -4, SEEK_END);
-  off2 = fget4(ifp);
-  fseek (ifp, off2, SEEK_SET);
-  while (fget4(ifp) != 0x464d4143)	/* Search for "CAMF" */
-    if (feof(ifp)) return;
-  off1 = fget4(ifp);
-  fseek (ifp, off1+8, SEEK_SET);
-  off1 += (fget4(ifp)+3) * 8;
-  len = (off2 - off1)/2;
-  fseek (ifp, off1, SEEK_SET);
-  buf = malloc (len);
-  merror (buf, "parse_foveon()");
-  for (i=0; i < len; i++)		/* Convert Unicode to ASCII */
-    buf[i] = fget2(ifp);
-  for (bp=buf; bp < buf+len; bp=np) {
-    np = bp + strlen(bp) + 1;
-    if (!strcmp(bp,"CAMMANUF"))
-      strcpy (make, np);
-    if (!strcmp(bp,"CAMMODEL"))
-      strcpy (model, np);
-  }
-  fseek (ifp, 248, SEEK_SET);
-  raw_width  = fget4(ifp);
-  raw_height = fget4(ifp);
-  free(buf);
-}
-
-void foveon_coeff()
+  dc->tiff_data_offset += tx * ty * 2;
+  strcpy (dc->make, "Rollei");
+  strcpy (dc->model, "d530flex");
+}
+
+/*
+   Copy a UTF-16 string from the CAMF block as ASCII.
+ */
+static void foveon_gets (char *dest, const uchar *up, const uchar *end)
+{
+  int i;
+
+  for (i=0; i < 63 && up+1 < end && (up[0] | up[1]); i++, up+=2)
+    dest[i] = up[0];
+  dest[i] = 0;
+}
+
+static void parse_foveon(struct dcraw *dc)
+{
+  static const uchar manuf[] =
+    { 'C',0,'A',0,'M',0,'M',0,'A',0,'N',0,'U',0,'F',0,0,0 },
+  camodel[] =
+    { 'C',0,'A',0,'M',0,'M',0,'O',0,'D',0,'E',0,'L',0,0,0 };
+  struct dcraw_view v;
+  uchar *dp, *bp, *np, *end;
+  int fsize, off1=0, off2, len, found;
+
+  dc->order = 0x4949;			/* Little-endian */
+  fseek (dc->ifp, 0, SEEK_END);
+  fsize = ftell(dc->ifp);
+  fseek (dc->ifp, -4, SEEK_END);
+  off2 = fget4(dc, dc->ifp);
+  if (off2 < 0 || off2 > fsize - 12) return;
+/*
+   Search the directory for "CAMF" on a four-byte boundary.
+   Let memchr(), which is vectorized in most C libraries, find
+   the candidates.
+ */
+  dp = open_view (&v, dc->ifp, off2, fsize - off2);
+  end = dp + fsize - off2 - 7;
+  for (bp=dp; (bp = memchr (bp, 'C', end-bp)); bp++)
+    if (((bp-dp) & 3) == 0 && !memcmp (bp, "CAMF", 4)) {
+      off1 = bp[4] | bp[5] << 8 | bp[6] << 16 | bp[7] << 24;
+      break;
+    }
+  close_view (&v);
+  if (!bp) return;
+  fseek (dc->ifp, off1+8, SEEK_SET);
+  off1 += (fget4(dc, dc->ifp)+3) * 8;
+  if (off1 < 0 || (len = (off2 - off1) & -2) <= 0) return;
+/*
+   The block is a list of null-terminated UTF-16 strings.  Compare
+   them in place, and convert only the values that we want.
+ */
+  dp = open_view (&v, dc->ifp, off1, len);
+  for (found=0, bp=dp, end=dp+len; bp < end && found < 2; bp=np) {
+    for (np=bp; np+1 < end && (np[0] | np[1]); np+=2);
+    np += 2;
+    if (np-bp == sizeof manuf && !memcmp (bp, manuf, sizeof manuf)) {
+      foveon_gets (dc->make, np, end);
+      found++;
+    }
+    if (np-bp == sizeof camodel && !memcmp (bp, camodel, sizeof camodel)) {
+      foveon_gets (dc->model, np, end);
+      found++;
+    }
+  }
+  close_view (&v);
+  fseek (dc->ifp, 248, SEEK_SET);
+  dc->raw_width  = fget4(dc, dc->ifp);
+  dc->raw_height = fget4(dc, dc->ifp);
+}
+
+static void foveon_coeff(struct dcraw *dc)
 {
   static const float foveon[3][3] = {
     {  2.0343955, -0.727533, -0.3067457 },
@@ -2064,15 +3511,15 @@ void foveon_coeff()
 
   for (i=0; i < 3; i++)
     for (j=0; j < 3; j++)
-      coeff[i][j] = foveon[i][j] * mul[i];
-  use_coeff = 1;
+      dc->coeff[i][j] = foveon[i][j] * mul[i];
+  dc->use_coeff = 1;
 }
 
 /*
    The grass is always greener in my PowerShot G2 when this
    function is called.  Use at your own risk!
  */
-void canon_rgb_coeff()
+static void canon_rgb_coeff(struct dcraw *dc)
 {
   static const float my_coeff[3][3] =
   { {  1.116187, -0.107427, -0.008760 },
@@ -2083,11 +3530,11 @@ void canon_rgb_coeff()
 
   for (i=0; i < 3; i++)
     for (j=0; j < 3; j++)
-      coeff[i][j] = my_coeff[i][j] * juice + (i==j) * (1-juice);
-  use_coeff = 1;
+      dc->coeff[i][j] = my_coeff[i][j] * juice + (i==j) * (1-juice);
+  dc->use_coeff = 1;
 }
 
-void nikon_e950_coeff()
+static void nikon_e950_coeff(struct dcraw *dc)
 {
   int r, g;
   static const float my_coeff[3][4] =
@@ -2097,8 +3544,8 @@ void nikon_e950_coeff()
 
   for (r=0; r < 3; r++)
     for (g=0; g < 4; g++)
-      coeff[r][g] = my_coeff[r][g];
-  use_coeff = 1;
+      dc->coeff[r][g] = my_coeff[r][g];
+  dc->use_coeff = 1;
 }
 
 /*
@@ -2107,7 +3554,7 @@ void nikon_e950_coeff()
    four 3x3 matrices by omitting a different GMCY color in each one.
    The final coeff[][] matrix is the sum of these four.
  */
-void gmcy_coeff()
+static void gmcy_coeff(struct dcraw *dc)
 {
   static const float gmcy[4][3] = {
 /*    red  green  blue			   */
@@ -2119,7 +3566,7 @@ void gmcy_coeff()
   double invert[3][6], num;
   int ignore, i, j, k, r, g;
 
-  memset (coeff, 0, sizeof coeff);
+  memset (dc->coeff, 0, sizeof dc->coeff);
   for (ignore=0; ignore < 4; ignore++) {
     for (j=0; j < 3; j++) {
       g = (j < ignore) ? j : j+1;
@@ -2142,694 +3589,970 @@ void gmcy_coeff()
     for (j=0; j < 3; j++) {		/* Add the result to coeff[][] */
       g = (j < ignore) ? j : j+1;
       for (r=0; r < 3; r++)
-	coeff[r][g] += invert[r][j+3];
+	dc->coeff[r][g] += invert[r][j+3];
     }
   }
   for (r=0; r < 3; r++) {		/* Normalize such that:		*/
     for (num=g=0; g < 4; g++)		/* (1,1,1,1) x coeff = (1,1,1) */
-      num += coeff[r][g];
+      num += dc->coeff[r][g];
     for (g=0; g < 4; g++)
-      coeff[r][g] /= num;
+      dc->coeff[r][g] /= num;
   }
-  use_coeff = 1;
+  dc->use_coeff = 1;
 }
 
 /*
-   Identify which camera created this file, and set global variables
+   Identify which camera created this file, and fill in dc
    accordingly.  Return nonzero if the file cannot be decoded.
  */
-int identify(char *fname)
+static int identify(struct dcraw *dc, char *fname)
 {
   char head[26], *c;
   unsigned hlen, fsize, magic, i;
 
-  pre_mul[0] = pre_mul[1] = pre_mul[2] = pre_mul[3] = 1;
-  camera_red = camera_blue = black = timestamp = 0;
-  rgb_max = 0x4000;
-  colors = 3;
-  is_cmy = is_foveon = use_coeff = 0;
-  ymag = 1;
-
-  strcpy (make, "NIKON");		/* wild guess */
-  model[0] = model2[0] = 0;
-  tiff_data_offset = 0;
-  order = fget2(ifp);
-  hlen = fget4(ifp);
-  fread (head, 1, 26, ifp);
-  fseek (ifp, 0, SEEK_END);
-  fsize = ftell(ifp);
-  fseek (ifp, 0, SEEK_SET);
-  magic = fget4(ifp);
-  if (order == 0x4949 || order == 0x4d4d) {
+  dc->pre_mul[0] = dc->pre_mul[1] = dc->pre_mul[2] = dc->pre_mul[3] = 1;
+  dc->camera_red = dc->camera_blue = dc->black = dc->timestamp = 0;
+  dc->rgb_max = 0x4000;
+  dc->colors = 3;
+  dc->is_cmy = dc->is_foveon = dc->use_coeff = 0;
+  dc->ymag = 1;
+
+  strcpy (dc->make, "NIKON");		/* wild guess */
+  dc->model[0] = dc->model2[0] = 0;
+  dc->tiff_data_offset = 0;
+  dc->thumb_offset = dc->thumb_length = 0;
+  dc->order = fget2(dc, dc->ifp);
+  hlen = fget4(dc, dc->ifp);
+  fread (head, 1, 26, dc->ifp);
+  fseek (dc->ifp, 0, SEEK_END);
+  fsize = ftell(dc->ifp);
+  fseek (dc->ifp, 0, SEEK_SET);
+  magic = fget4(dc, dc->ifp);
+  if (dc->order == 0x4949 || dc->order == 0x4d4d) {
     if (!memcmp(head,"HEAPCCDR",8)) {
-      parse_ciff (hlen, fsize - hlen);
-      fseek (ifp, hlen, SEEK_SET);
+      parse_ciff (dc, hlen, fsize - hlen);
+      fseek (dc->ifp, hlen, SEEK_SET);
     } else
-      parse_tiff(0);
+      parse_tiff(dc, 0);
   } else if (magic == 0x4d524d) {	/* "\0MRM" (Minolta) */
-    parse_tiff(48);
-    fseek (ifp, 4, SEEK_SET);
-    tiff_data_offset = fget4(ifp) + 8;
-    fseek (ifp, 24, SEEK_SET);
-    raw_height = fget2(ifp);
-    raw_width  = fget2(ifp);
+    parse_tiff(dc, 48);
+    fseek (dc->ifp, 4, SEEK_SET);
+    dc->tiff_data_offset = fget4(dc, dc->ifp) + 8;
+    fseek (dc->ifp, 24, SEEK_SET);
+    dc->raw_height = fget2(dc, dc->ifp);
+    dc->raw_width  = fget2(dc, dc->ifp);
   } else if (magic >> 16 == 0x424d) {	/* "BM" */
-    tiff_data_offset = 0x1000;
-    order = 0x4949;
-    fseek (ifp, 38, SEEK_SET);
-    if (fget4(ifp) == 2834 && fget4(ifp) == 2834) {
-      strcpy (model,"BMQ");
+    dc->tiff_data_offset = 0x1000;
+    dc->order = 0x4949;
+    fseek (dc->ifp, 38, SEEK_SET);
+    if (fget4(dc, dc->ifp) == 2834 && fget4(dc, dc->ifp) == 2834) {
+      strcpy (dc->model,"BMQ");
       goto nucore;
     }
   } else if (magic >> 16 == 0x4252) {	/* "BR" */
-    strcpy (model,"RAW");
+    strcpy (dc->model,"RAW");
     nucore:
-    strcpy (make,"Nucore");
-    order = 0x4949;
-    fseek (ifp, 10, SEEK_SET);
-    tiff_data_offset += fget4(ifp);
-    fget4(ifp);
-    raw_width = fget4(ifp);
-    raw_height = fget4(ifp);
-    if (model[0] == 'B' && raw_width == 2597) {
-      raw_width++;
-      tiff_data_offset -= 0x1000;
+    strcpy (dc->make,"Nucore");
+    dc->order = 0x4949;
+    fseek (dc->ifp, 10, SEEK_SET);
+    dc->tiff_data_offset += fget4(dc, dc->ifp);
+    fget4(dc, dc->ifp);
+    dc->raw_width = fget4(dc, dc->ifp);
+    dc->raw_height = fget4(dc, dc->ifp);
+    if (dc->model[0] == 'B' && dc->raw_width == 2597) {
+      dc->raw_width++;
+      dc->tiff_data_offset -= 0x1000;
     }
   } else if (!memcmp(head+19,"ARECOYK",7)) {
-    strcpy (make, "CONTAX");
-    strcpy (model, "N DIGITAL");
+    strcpy (dc->make, "CONTAX");
+    strcpy (dc->model, "N DIGITAL");
   } else if (magic == 0x46554a49) {	/* "FUJI" */
-    fseek (ifp, 84, SEEK_SET);
-    parse_tiff (fget4(ifp)+12);
-    order = 0x4d4d;
-    fseek (ifp, 100, SEEK_SET);
-    tiff_data_offset = fget4(ifp);
+    fseek (dc->ifp, 84, SEEK_SET);
+    parse_tiff (dc, fget4(dc, dc->ifp)+12);
+    dc->order = 0x4d4d;
+    fseek (dc->ifp, 100, SEEK_SET);
+    dc->tiff_data_offset = fget4(dc, dc->ifp);
   } else if (magic == 0x4453432d)	/* "DSC-" */
-    parse_rollei();
+    parse_rollei(dc);
   else if (magic == 0x464f5662)		/* "FOVb" */
-    parse_foveon();
+    parse_foveon(dc);
   else if (fsize == 2465792)		/* Nikon "DIAG RAW" formats */
-    strcpy (model,"E950");
+    strcpy (dc->model,"E950");
   else if (fsize == 2940928)
-    strcpy (model,"E2500");
+    strcpy (dc->model,"E2500");
   else if (fsize == 4771840)
-    strcpy (model,"E990/995");
+    strcpy (dc->model,"E990/995");
   else if (fsize == 5865472)
-    strcpy (model,"E4500");
+    strcpy (dc->model,"E4500");
   else if (fsize == 5869568)
-    strcpy (model,"E4300");
+    strcpy (dc->model,"E4300");
   else {
-    strcpy (make, "Casio");		/* Casio has similar formats */
+    strcpy (dc->make, "Casio");		/* Casio has similar formats */
     if (fsize == 1976352)
-      strcpy (model, "QV-2000UX");
+      strcpy (dc->model, "QV-2000UX");
     else if (fsize == 3217760)
-      strcpy (model, "QV-3*00EX");
+      strcpy (dc->model, "QV-3*00EX");
     else if (fsize == 7684000)
-      strcpy (model, "QV-4000");
+      strcpy (dc->model, "QV-4000");
     else if (fsize == 6218368)
-      strcpy (model, "QV-5700");
+      strcpy (dc->model, "QV-5700");
   }
 
   /* Remove excess wordage */
-  if (!strncmp(make,"NIKON",5) || !strncmp(make,"Canon",5))
-    make[5] = 0;
-  if (!strncmp(make,"PENTAX",6))
-    make[6] = 0;
-  if (!strncmp(make,"OLYMPUS",7) || !strncmp(make,"Minolta",7))
-    make[7] = 0;
-  if (!strncmp(make,"KODAK",5))
-    make[16] = model[16] = 0;
-  i = strlen(make);
-  if (!strncmp(model,make,i++))
-    memmove (model, model+i, 64-i);
+  if (!strncmp(dc->make,"NIKON",5) || !strncmp(dc->make,"Canon",5))
+    dc->make[5] = 0;
+  if (!strncmp(dc->make,"PENTAX",6))
+    dc->make[6] = 0;
+  if (!strncmp(dc->make,"OLYMPUS",7) || !strncmp(dc->make,"Minolta",7))
+    dc->make[7] = 0;
+  if (!strncmp(dc->make,"KODAK",5))
+    dc->make[16] = dc->model[16] = 0;
+  i = strlen(dc->make);
+  if (!strncmp(dc->model,dc->make,i++))
+    memmove (dc->model, dc->model+i, 64-i);
 
   /* Remove trailing spaces */
-  c = make + strlen(make);
+  c = dc->make + strlen(dc->make);
   while (*--c == ' ') *c = 0;
-  c = model + strlen(model);
+  c = dc->model + strlen(dc->model);
   while (*--c == ' ') *c = 0;
-  if (model[0] == 0) {
+  if (dc->model[0] == 0) {
     fprintf (stderr, "%s: unsupported file format.\n", fname);
     return 1;
   }
-  is_canon = !strcmp(make,"Canon");
-  if (!strcmp(model,"PowerShot 600")) {
-    height = 613;
-    width  = 854;
-    colors = 4;
-    filters = 0xe1e4e1e4;
-    load_raw = ps600_load_raw;
-    pre_mul[0] = 1.137;
-    pre_mul[1] = 1.257;
-  } else if (!strcmp(model,"PowerShot A5")) {
-    height = 776;
-    width  = 960;
-    colors = 4;
-    filters = 0x1e4e1e4e;
-    load_raw = a5_load_raw;
-    pre_mul[0] = 1.5842;
-    pre_mul[1] = 1.2966;
-    pre_mul[2] = 1.0419;
-  } else if (!strcmp(model,"PowerShot A50")) {
-    height =  968;
-    width  = 1290;
-    colors = 4;
-    filters = 0x1b4e4b1e;
-    load_raw = a50_load_raw;
-    pre_mul[0] = 1.750;
-    pre_mul[1] = 1.381;
-    pre_mul[3] = 1.182;
-  } else if (!strcmp(model,"PowerShot Pro70")) {
-    height = 1024;
-    width  = 1552;
-    colors = 4;
-    filters = 0x1e4b4e1b;
-    load_raw = pro70_load_raw;
-    pre_mul[0] = 1.389;
-    pre_mul[1] = 1.343;
-    pre_mul[3] = 1.034;
-  } else if (!strcmp(model,"PowerShot Pro90 IS")) {
-    height = 1416;
-    width  = 1896;
-    colors = 4;
-    filters = 0xb4b4b4b4;
-    load_raw = canon_compressed_load_raw;
-    pre_mul[0] = 1.496;
-    pre_mul[1] = 1.509;
-    pre_mul[3] = 1.009;
-  } else if (!strcmp(model,"PowerShot G1")) {
-    height = 1550;
-    width  = 2088;
-    colors = 4;
-    filters = 0xb4b4b4b4;
-    load_raw = canon_compressed_load_raw;
-    pre_mul[0] = 1.446;
-    pre_mul[1] = 1.405;
-    pre_mul[2] = 1.016;
-  } else if (!strcmp(model,"PowerShot S30")) {
-    height = 1550;
-    width  = 2088;
-    filters = 0x94949494;
-    load_raw = canon_compressed_load_raw;
-    pre_mul[0] = 1.785;
-    pre_mul[2] = 1.266;
-  } else if (!strcmp(model,"PowerShot G2")  ||
-	     !strcmp(model,"PowerShot G3")  ||
-	     !strcmp(model,"PowerShot S40") ||
-	     !strcmp(model,"PowerShot S45")) {
-    height = 1720;
-    width  = 2312;
-    filters = 0x94949494;
-    load_raw = canon_compressed_load_raw;
-    if (write_fun == write_ppm)		/* Pro users may not want my matrix */
-      canon_rgb_coeff();
-    pre_mul[0] = 1.965;
-    pre_mul[2] = 1.208;
-  } else if (!strcmp(model,"PowerShot G5")  ||
-	     !strcmp(model,"PowerShot S50")) {
-    height = 1960;
-    width  = 2616;
-    filters = 0x94949494;
-    load_raw = canon_compressed_load_raw;
-    pre_mul[0] = 1.895;
-    pre_mul[2] = 1.403;
-  } else if (!strcmp(model,"EOS D30")) {
-    height = 1448;
-    width  = 2176;
-    filters = 0x94949494;
-    load_raw = canon_compressed_load_raw;
-    pre_mul[0] = 1.592;
-    pre_mul[2] = 1.261;
-  } else if (!strcmp(model,"EOS D60") ||
-	     !strcmp(model,"EOS 10D") ||
-	     !strcmp(model,"EOS 300D DIGITAL") ||
-	     !strcmp(model,"EOS DIGITAL REBEL")) {
-    height = 2056;
-    width  = 3088;
-    filters = 0x94949494;
-    load_raw = canon_compressed_load_raw;
-    pre_mul[0] = 2.242;
-    pre_mul[2] = 1.245;
-    rgb_max = 16000;
-  } else if (!strcmp(model,"EOS-1D")) {
-    height = 1662;
-    width  = 2496;
-    filters = 0x61616161;
-    load_raw = lossless_jpeg_load_raw;
-    tiff_data_offset = 288912;
-    pre_mul[0] = 1.976;
-    pre_mul[2] = 1.282;
-  } else if (!strcmp(model,"EOS-1DS")) {
-    height = 2718;
-    width  = 4082;
-    filters = 0x61616161;
-    load_raw = lossless_jpeg_load_raw;
-    tiff_data_offset = 289168;
-    pre_mul[0] = 1.66;
-    pre_mul[2] = 1.13;
-    rgb_max = 14464;
-  } else if (!strcmp(model,"EOS D2000C")) {
-    height = raw_height;
-    width  = raw_width;
-    filters = 0x61616161;
-    load_raw = lossless_jpeg_load_raw;
-    black = 800;
-    pre_mul[2] = 1.25;
-  } else if (!strcmp(model,"D1")) {
-    height = 1324;
-    width  = 2012;
-    filters = 0x16161616;
-    load_raw = nikon_load_raw;
-    pre_mul[0] = 0.838;
-    pre_mul[2] = 1.095;
-  } else if (!strcmp(model,"D1H")) {
-    height = 1324;
-    width  = 2012;
-    filters = 0x16161616;
-    load_raw = nikon_load_raw;
-    pre_mul[0] = 1.347;
-    pre_mul[2] = 3.279;
-  } else if (!strcmp(model,"D1X")) {
-    height = 1324;
-    width  = 4024;
-    filters = 0x16161616;
-    ymag = 2;
-    load_raw = nikon_load_raw;
-    pre_mul[0] = 1.910;
-    pre_mul[2] = 1.220;
-  } else if (!strcmp(model,"D100")) {
-    height = 2024;
-    width  = 3037;
-    filters = 0x61616161;
-    load_raw = nikon_load_raw;
-    pre_mul[0] = 2.374;
-    pre_mul[2] = 1.677;
-    rgb_max = 15632;
-  } else if (!strcmp(model,"D2H")) {
-    height = 1648;
-    width  = 2482;
-    filters = 0x49494949;
-    load_raw = nikon_load_raw;
-    pre_mul[0] = 2.8;
-    pre_mul[2] = 1.2;
-  } else if (!strcmp(model,"E950")) {
-    height = 1203;
-    width  = 1616;
-    filters = 0x4b4b4b4b;
-    colors = 4;
-    load_raw = nikon_e950_load_raw;
-    nikon_e950_coeff();
-    pre_mul[0] = 1.18193;
-    pre_mul[2] = 1.16452;
-    pre_mul[3] = 1.17250;
-  } else if (!strcmp(model,"E990/995")) {
-    height = 1540;
-    width  = 2064;
-    filters = 0xb4b4b4b4;
-    colors = 4;
-    load_raw = nikon_load_raw;
-    nikon_e950_coeff();
-    pre_mul[0] = 1.196;
-    pre_mul[1] = 1.246;
-    pre_mul[2] = 1.018;
-  } else if (!strcmp(model,"E2500")) {
-    height = 1204;
-    width  = 1616;
-    filters = 0x4b4b4b4b;
+  if (dc->thumbnail_only && dc->thumb_length)  /* Nothing else is needed */
+    return 0;
+  dc->is_canon = !strcmp(dc->make,"Canon");
+  if (!strcmp(dc->model,"PowerShot 600")) {
+    dc->height = 613;
+    dc->width  = 854;
+    dc->colors = 4;
+    dc->filters = 0xe1e4e1e4;
+    dc->load_raw = ps600_load_raw;
+    dc->pre_mul[0] = 1.137;
+    dc->pre_mul[1] = 1.257;
+  } else if (!strcmp(dc->model,"PowerShot A5")) {
+    dc->height = 776;
+    dc->width  = 960;
+    dc->colors = 4;
+    dc->filters = 0x1e4e1e4e;
+    dc->load_raw = a5_load_raw;
+    dc->pre_mul[0] = 1.5842;
+    dc->pre_mul[1] = 1.2966;
+    dc->pre_mul[2] = 1.0419;
+  } else if (!strcmp(dc->model,"PowerShot A50")) {
+    dc->height =  968;
+    dc->width  = 1290;
+    dc->colors = 4;
+    dc->filters = 0x1b4e4b1e;
+    dc->load_raw = a50_load_raw;
+    dc->pre_mul[0] = 1.750;
+    dc->pre_mul[1] = 1.381;
+    dc->pre_mul[3] = 1.182;
+  } else if (!strcmp(dc->model,"PowerShot Pro70")) {
+    dc->height = 1024;
+    dc->width  = 1552;
+    dc->colors = 4;
+    dc->filters = 0x1e4b4e1b;
+    dc->load_raw = pro70_load_raw;
+    dc->pre_mul[0] = 1.389;
+    dc->pre_mul[1] = 1.343;
+    dc->pre_mul[3] = 1.034;
+  } else if (!strcmp(dc->model,"PowerShot Pro90 IS")) {
+    dc->height = 1416;
+    dc->width  = 1896;
+    dc->colors = 4;
+    dc->filters = 0xb4b4b4b4;
+    dc->load_raw = canon_compressed_load_raw;
+    dc->pre_mul[0] = 1.496;
+    dc->pre_mul[1] = 1.509;
+    dc->pre_mul[3] = 1.009;
+  } else if (!strcmp(dc->model,"PowerShot G1")) {
+    dc->height = 1550;
+    dc->width  = 2088;
+    dc->colors = 4;
+    dc->filters = 0xb4b4b4b4;
+    dc->load_raw = canon_compressed_load_raw;
+    dc->pre_mul[0] = 1.446;
+    dc->pre_mul[1] = 1.405;
+    dc->pre_mul[2] = 1.016;
+  } else if (!strcmp(dc->model,"PowerShot S30")) {
+    dc->height = 1550;
+    dc->width  = 2088;
+    dc->filters = 0x94949494;
+    dc->load_raw = canon_compressed_load_raw;
+    dc->pre_mul[0] = 1.785;
+    dc->pre_mul[2] = 1.266;
+  } else if (!strcmp(dc->model,"PowerShot G2")  ||
+	     !strcmp(dc->model,"PowerShot G3")  ||
+	     !strcmp(dc->model,"PowerShot S40") ||
+	     !strcmp(dc->model,"PowerShot S45")) {
+    dc->height = 1720;
+    dc->width  = 2312;
+    dc->filters = 0x94949494;
+    dc->load_raw = canon_compressed_load_raw;
+    if (dc->write_fun == dcraw_write_ppm)	/* Pro users may not want my matrix */
+      canon_rgb_coeff(dc);
+    dc->pre_mul[0] = 1.965;
+    dc->pre_mul[2] = 1.208;
+  } else if (!strcmp(dc->model,"PowerShot G5")  ||
+	     !strcmp(dc->model,"PowerShot S50")) {
+    dc->height = 1960;
+    dc->width  = 2616;
+    dc->filters = 0x94949494;
+    dc->load_raw = canon_compressed_load_raw;
+    dc->pre_mul[0] = 1.895;
+    dc->pre_mul[2] = 1.403;
+  } else if (!strcmp(dc->model,"EOS D30")) {
+    dc->height = 1448;
+    dc->width  = 2176;
+    dc->filters = 0x94949494;
+    dc->load_raw = canon_compressed_load_raw;
+    dc->pre_mul[0] = 1.592;
+    dc->pre_mul[2] = 1.261;
+  } else if (!strcmp(dc->model,"EOS D60") ||
+	     !strcmp(dc->model,"EOS 10D") ||
+	     !strcmp(dc->model,"EOS 300D DIGITAL") ||
+	     !strcmp(dc->model,"EOS DIGITAL REBEL")) {
+    dc->height = 2056;
+    dc->width  = 3088;
+    dc->filters = 0x94949494;
+    dc->load_raw = canon_compressed_load_raw;
+    dc->pre_mul[0] = 2.242;
+    dc->pre_mul[2] = 1.245;
+    dc->rgb_max = 16000;
+  } else if (!strcmp(dc->model,"EOS-1D")) {
+    dc->height = 1662;
+    dc->width  = 2496;
+    dc->filters = 0x61616161;
+    dc->load_raw = lossless_jpeg_load_raw;
+    dc->tiff_data_offset = 288912;
+    dc->pre_mul[0] = 1.976;
+    dc->pre_mul[2] = 1.282;
+  } else if (!strcmp(dc->model,"EOS-1DS")) {
+    dc->height = 2718;
+    dc->width  = 4082;
+    dc->filters = 0x61616161;
+    dc->load_raw = lossless_jpeg_load_raw;
+    dc->tiff_data_offset = 289168;
+    dc->pre_mul[0] = 1.66;
+    dc->pre_mul[2] = 1.13;
+    dc->rgb_max = 14464;
+  } else if (!strcmp(dc->model,"EOS D2000C")) {
+    dc->height = dc->raw_height;
+    dc->width  = dc->raw_width;
+    dc->filters = 0x61616161;
+    dc->load_raw = lossless_jpeg_load_raw;
+    dc->black = 800;
+    dc->pre_mul[2] = 1.25;
+  } else if (!strcmp(dc->model,"D1")) {
+    dc->height = 1324;
+    dc->width  = 2012;
+    dc->filters = 0x16161616;
+    dc->load_raw = nikon_load_raw;
+    dc->pre_mul[0] = 0.838;
+    dc->pre_mul[2] = 1.095;
+  } else if (!strcmp(dc->model,"D1H")) {
+    dc->height = 1324;
+    dc->width  = 2012;
+    dc->filters = 0x16161616;
+    dc->load_raw = nikon_load_raw;
+    dc->pre_mul[0] = 1.347;
+    dc->pre_mul[2] = 3.279;
+  } else if (!strcmp(dc->model,"D1X")) {
+    dc->height = 1324;
+    dc->width  = 4024;
+    dc->filters = 0x16161616;
+    dc->ymag = 2;
+    dc->load_raw = nikon_load_raw;
+    dc->pre_mul[0] = 1.910;
+    dc->pre_mul[2] = 1.220;
+  } else if (!strcmp(dc->model,"D100")) {
+    dc->height = 2024;
+    dc->width  = 3037;
+    dc->filters = 0x61616161;
+    dc->load_raw = nikon_load_raw;
+    dc->pre_mul[0] = 2.374;
+    dc->pre_mul[2] = 1.677;
+    dc->rgb_max = 15632;
+  } else if (!strcmp(dc->model,"D2H")) {
+    dc->height = 1648;
+    dc->width  = 2482;
+    dc->filters = 0x49494949;
+    dc->load_raw = nikon_load_raw;
+    dc->pre_mul[0] = 2.8;
+    dc->pre_mul[2] = 1.2;
+  } else if (!strcmp(dc->model,"E950")) {
+    dc->height = 1203;
+    dc->width  = 1616;
+    dc->filters = 0x4b4b4b4b;
+    dc->colors = 4;
+    dc->load_raw = nikon_e950_load_raw;
+    nikon_e950_coeff(dc);
+    dc->pre_mul[0] = 1.18193;
+    dc->pre_mul[2] = 1.16452;
+    dc->pre_mul[3] = 1.17250;
+  } else if (!strcmp(dc->model,"E990/995")) {
+    dc->height = 1540;
+    dc->width  = 2064;
+    dc->filters = 0xb4b4b4b4;
+    dc->colors = 4;
+    dc->load_raw = nikon_load_raw;
+    nikon_e950_coeff(dc);
+    dc->pre_mul[0] = 1.196;
+    dc->pre_mul[1] = 1.246;
+    dc->pre_mul[2] = 1.018;
+  } else if (!strcmp(dc->model,"E2500")) {
+    dc->height = 1204;
+    dc->width  = 1616;
+    dc->filters = 0x4b4b4b4b;
     goto coolpix;
-  } else if (!strcmp(model,"E4300")) {
-    height = 1710;
-    width  = 2288;
-    filters = 0x16161616;
-    load_raw = nikon_load_raw;
-  } else if (!strcmp(model,"E4500")) {
-    height = 1708;
-    width  = 2288;
-    filters = 0xb4b4b4b4;
+  } else if (!strcmp(dc->model,"E4300")) {
+    dc->height = 1710;
+    dc->width  = 2288;
+    dc->filters = 0x16161616;
+    dc->load_raw = nikon_load_raw;
+  } else if (!strcmp(dc->model,"E4500")) {
+    dc->height = 1708;
+    dc->width  = 2288;
+    dc->filters = 0xb4b4b4b4;
     goto coolpix;
-  } else if (!strcmp(model,"E5000") || !strcmp(model,"E5700")) {
-    height = 1924;
-    width  = 2576;
-    filters = 0xb4b4b4b4;
+  } else if (!strcmp(dc->model,"E5000") || !strcmp(dc->model,"E5700")) {
+    dc->height = 1924;
+    dc->width  = 2576;
+    dc->filters = 0xb4b4b4b4;
     coolpix:
-    colors = 4;
-    load_raw = nikon_load_raw;
-    pre_mul[0] = 1.300;
-    pre_mul[1] = 1.300;
-    pre_mul[3] = 1.148;
-  } else if (!strcmp(model,"FinePixS2Pro")) {
-    height = 3584;
-    width  = 3583;
-    filters = 0x61616161;
-    load_raw = fuji_s2_load_raw;
-    pre_mul[0] = 1.424;
-    pre_mul[2] = 1.718;
-  } else if (!strcmp(model,"FinePix S5000")) {
-    height = 2499;
-    width  = 2500;
-    filters = 0x49494949;
-    load_raw = fuji_s5000_load_raw;
-    pre_mul[0] = 1.639;
-    pre_mul[2] = 1.438;
-  } else if (!strcmp(model,"FinePix F700")) {
-    height = 2523;
-    width  = 2524;
-    filters = 0x49494949;
-    load_raw = fuji_f700_load_raw;
-    pre_mul[0] = 1.639;
-    pre_mul[2] = 1.438;
-    rgb_max = 0xffff;
-  } else if (!strcmp(make,"Minolta")) {
-    height = raw_height;
-    width  = raw_width;
-    filters = 0x94949494;
-    load_raw = unpacked_12_load_raw;
-    if (!strcmp(model,"DiMAGE A1"))
-      load_raw = packed_12_load_raw;
-    pre_mul[0] = 1.57;
-    pre_mul[2] = 1.42;
-  } else if (!strcmp(model,"*ist D")) {
-    height = 2024;
-    width  = 3040;
-    filters = 0x94949494;
-    tiff_data_offset = 0x10000;
-    load_raw = unpacked_12_load_raw;
-    pre_mul[0] = 1.76;
-    pre_mul[1] = 1.07;
-  } else if (!strcmp(model,"E-10")) {
-    height = 1684;
-    width  = 2256;
-    filters = 0x94949494;
-    tiff_data_offset = 0x4000;
-    load_raw = olympus_load_raw;
-    pre_mul[0] = 1.43;
-    pre_mul[2] = 1.77;
-  } else if (!strncmp(model,"E-20",4)) {
-    height = 1924;
-    width  = 2576;
-    filters = 0x94949494;
-    tiff_data_offset = 0x4000;
-    load_raw = olympus_load_raw;
-    pre_mul[0] = 1.43;
-    pre_mul[2] = 1.77;
-  } else if (!strcmp(model,"C5050Z")) {
-    height = 1926;
-    width  = 2576;
-    filters = 0x16161616;
-    load_raw = olympus2_load_raw;
-    pre_mul[0] = 1.533;
-    pre_mul[2] = 1.880;
-  } else if (!strcmp(model,"N DIGITAL")) {
-    height = 2047;
-    width  = 3072;
-    filters = 0x61616161;
-    tiff_data_offset = 0x1a00;
-    load_raw = kyocera_load_raw;
-    pre_mul[0] = 1.366;
-    pre_mul[2] = 1.251;
-  } else if (!strcasecmp(make,"KODAK")) {
-    height = raw_height;
-    width  = raw_width;
-    filters = 0x61616161;
-    black = 400;
-    if (!strcmp(model,"DCS315C")) {
-      pre_mul[0] = 0.973;
-      pre_mul[2] = 0.987;
-      black = 0;
-    } else if (!strcmp(model,"DCS330C")) {
-      pre_mul[0] = 0.996;
-      pre_mul[2] = 1.279;
-      black = 0;
-    } else if (!strcmp(model,"DCS420")) {
-      pre_mul[0] = 1.21;
-      pre_mul[2] = 1.63;
-      width -= 4;
-    } else if (!strcmp(model,"DCS460")) {
-      pre_mul[0] = 1.46;
-      pre_mul[2] = 1.84;
-      width -= 4;
-    } else if (!strcmp(model,"DCS460A")) {
-      colors = 1;
-      filters = 0;
-      width -= 4;
-    } else if (!strcmp(model,"EOSDCS3B")) {
-      pre_mul[0] = 1.43;
-      pre_mul[2] = 2.16;
-      width -= 4;
-    } else if (!strcmp(model,"EOSDCS1")) {
-      pre_mul[0] = 1.28;
-      pre_mul[2] = 2.00;
-      width -= 4;
-    } else if (!strcmp(model,"DCS520C")) {
-      pre_mul[0] = 1.00;
-      pre_mul[2] = 1.20;
-    } else if (!strcmp(model,"DCS560C")) {
-      pre_mul[0] = 0.985;
-      pre_mul[2] = 1.15;
-    } else if (!strcmp(model,"DCS620C")) {
-      pre_mul[0] = 1.00;
-      pre_mul[2] = 1.20;
-    } else if (!strcmp(model,"DCS620X")) {
-      pre_mul[0] = 1.12;
-      pre_mul[2] = 1.07;
-      is_cmy = 1;
-    } else if (!strcmp(model,"DCS660C")) {
-      pre_mul[0] = 1.05;
-      pre_mul[2] = 1.17;
-    } else if (!strcmp(model,"DCS660M")) {
-      colors = 1;
-      filters = 0;
-    } else if (!strcmp(model,"DCS720X")) {
-      pre_mul[0] = 1.35;
-      pre_mul[2] = 1.18;
-      is_cmy = 1;
-    } else if (!strcmp(model,"DCS760C")) {
-      pre_mul[0] = 1.06;
-      pre_mul[2] = 1.72;
-    } else if (!strcmp(model,"DCS760M")) {
-      colors = 1;
-      filters = 0;
-    } else if (!strcmp(model,"ProBack")) {
-      pre_mul[0] = 1.06;
-      pre_mul[2] = 1.385;
-    } else if (!strncmp(model2,"PB645C",6)) {
-      pre_mul[0] = 1.0497;
-      pre_mul[2] = 1.3306;
-    } else if (!strncmp(model2,"PB645H",6)) {
-      pre_mul[0] = 1.2010;
-      pre_mul[2] = 1.5061;
-    } else if (!strncmp(model2,"PB645M",6)) {
-      pre_mul[0] = 1.01755;
-      pre_mul[2] = 1.5424;
-    } else if (!strcasecmp(model,"DCS Pro 14n")) {
-      pre_mul[1] = 1.0191;
-      pre_mul[2] = 1.1567;
-    }
-    switch (tiff_data_compression) {
+    dc->colors = 4;
+    dc->load_raw = nikon_load_raw;
+    dc->pre_mul[0] = 1.300;
+    dc->pre_mul[1] = 1.300;
+    dc->pre_mul[3] = 1.148;
+  } else if (!strcmp(dc->model,"FinePixS2Pro")) {
+    dc->height = 3584;
+    dc->width  = 3583;
+    dc->filters = 0x61616161;
+    dc->load_raw = fuji_s2_load_raw;
+    dc->pre_mul[0] = 1.424;
+    dc->pre_mul[2] = 1.718;
+  } else if (!strcmp(dc->model,"FinePix S5000")) {
+    dc->height = 2499;
+    dc->width  = 2500;
+    dc->filters = 0x49494949;
+    dc->load_raw = fuji_s5000_load_raw;
+    dc->pre_mul[0] = 1.639;
+    dc->pre_mul[2] = 1.438;
+  } else if (!strcmp(dc->model,"FinePix F700")) {
+    dc->height = 2523;
+    dc->width  = 2524;
+    dc->filters = 0x49494949;
+    dc->load_raw = fuji_f700_load_raw;
+    dc->pre_mul[0] = 1.639;
+    dc->pre_mul[2] = 1.438;
+    dc->rgb_max = 0xffff;
+  } else if (!strcmp(dc->make,"Minolta")) {
+    dc->height = dc->raw_height;
+    dc->width  = dc->raw_width;
+    dc->filters = 0x94949494;
+    dc->load_raw = unpacked_12_load_raw;
+    if (!strcmp(dc->model,"DiMAGE A1"))
+      dc->load_raw = packed_12_load_raw;
+    dc->pre_mul[0] = 1.57;
+    dc->pre_mul[2] = 1.42;
+  } else if (!strcmp(dc->model,"*ist D")) {
+    dc->height = 2024;
+    dc->width  = 3040;
+    dc->filters = 0x94949494;
+    dc->tiff_data_offset = 0x10000;
+    dc->load_raw = unpacked_12_load_raw;
+    dc->pre_mul[0] = 1.76;
+    dc->pre_mul[1] = 1.07;
+  } else if (!strcmp(dc->model,"E-10")) {
+    dc->height = 1684;
+    dc->width  = 2256;
+    dc->filters = 0x94949494;
+    dc->tiff_data_offset = 0x4000;
+    dc->load_raw = olympus_load_raw;
+    dc->pre_mul[0] = 1.43;
+    dc->pre_mul[2] = 1.77;
+  } else if (!strncmp(dc->model,"E-20",4)) {
+    dc->height = 1924;
+    dc->width  = 2576;
+    dc->filters = 0x94949494;
+    dc->tiff_data_offset = 0x4000;
+    dc->load_raw = olympus_load_raw;
+    dc->pre_mul[0] = 1.43;
+    dc->pre_mul[2] = 1.77;
+  } else if (!strcmp(dc->model,"C5050Z")) {
+    dc->height = 1926;
+    dc->width  = 2576;
+    dc->filters = 0x16161616;
+    dc->load_raw = olympus2_load_raw;
+    dc->pre_mul[0] = 1.533;
+    dc->pre_mul[2] = 1.880;
+  } else if (!strcmp(dc->model,"N DIGITAL")) {
+    dc->height = 2047;
+    dc->width  = 3072;
+    dc->filters = 0x61616161;
+    dc->tiff_data_offset = 0x1a00;
+    dc->load_raw = kyocera_load_raw;
+    dc->pre_mul[0] = 1.366;
+    dc->pre_mul[2] = 1.251;
+  } else if (!strcasecmp(dc->make,"KODAK")) {
+    dc->height = dc->raw_height;
+    dc->width  = dc->raw_width;
+    dc->filters = 0x61616161;
+    dc->black = 400;
+    if (!strcmp(dc->model,"DCS315C")) {
+      dc->pre_mul[0] = 0.973;
+      dc->pre_mul[2] = 0.987;
+      dc->black = 0;
+    } else if (!strcmp(dc->model,"DCS330C")) {
+      dc->pre_mul[0] = 0.996;
+      dc->pre_mul[2] = 1.279;
+      dc->black = 0;
+    } else if (!strcmp(dc->model,"DCS420")) {
+      dc->pre_mul[0] = 1.21;
+      dc->pre_mul[2] = 1.63;
+      dc->width -= 4;
+    } else if (!strcmp(dc->model,"DCS460")) {
+      dc->pre_mul[0] = 1.46;
+      dc->pre_mul[2] = 1.84;
+      dc->width -= 4;
+    } else if (!strcmp(dc->model,"DCS460A")) {
+      dc->colors = 1;
+      dc->filters = 0;
+      dc->width -= 4;
+    } else if (!strcmp(dc->model,"EOSDCS3B")) {
+      dc->pre_mul[0] = 1.43;
+      dc->pre_mul[2] = 2.16;
+      dc->width -= 4;
+    } else if (!strcmp(dc->model,"EOSDCS1")) {
+      dc->pre_mul[0] = 1.28;
+      dc->pre_mul[2] = 2.00;
+      dc->width -= 4;
+    } else if (!strcmp(dc->model,"DCS520C")) {
+      dc->pre_mul[0] = 1.00;
+      dc->pre_mul[2] = 1.20;
+    } else if (!strcmp(dc->model,"DCS560C")) {
+      dc->pre_mul[0] = 0.985;
+      dc->pre_mul[2] = 1.15;
+    } else if (!strcmp(dc->model,"DCS620C")) {
+      dc->pre_mul[0] = 1.00;
+      dc->pre_mul[2] = 1.20;
+    } else if (!strcmp(dc->model,"DCS620X")) {
+      dc->pre_mul[0] = 1.12;
+      dc->pre_mul[2] = 1.07;
+      dc->is_cmy = 1;
+    } else if (!strcmp(dc->model,"DCS660C")) {
+      dc->pre_mul[0] = 1.05;
+      dc->pre_mul[2] = 1.17;
+    } else if (!strcmp(dc->model,"DCS660M")) {
+      dc->colors = 1;
+      dc->filters = 0;
+    } else if (!strcmp(dc->model,"DCS720X")) {
+      dc->pre_mul[0] = 1.35;
+      dc->pre_mul[2] = 1.18;
+      dc->is_cmy = 1;
+    } else if (!strcmp(dc->model,"DCS760C")) {
+      dc->pre_mul[0] = 1.06;
+      dc->pre_mul[2] = 1.72;
+    } else if (!strcmp(dc->model,"DCS760M")) {
+      dc->colors = 1;
+      dc->filters = 0;
+    } else if (!strcmp(dc->model,"ProBack")) {
+      dc->pre_mul[0] = 1.06;
+      dc->pre_mul[2] = 1.385;
+    } else if (!strncmp(dc->model2,"PB645C",6)) {
+      dc->pre_mul[0] = 1.0497;
+      dc->pre_mul[2] = 1.3306;
+    } else if (!strncmp(dc->model2,"PB645H",6)) {
+      dc->pre_mul[0] = 1.2010;
+      dc->pre_mul[2] = 1.5061;
+    } else if (!strncmp(dc->model2,"PB645M",6)) {
+      dc->pre_mul[0] = 1.01755;
+      dc->pre_mul[2] = 1.5424;
+    } else if (!strcasecmp(dc->model,"DCS Pro 14n")) {
+      dc->pre_mul[1] = 1.0191;
+      dc->pre_mul[2] = 1.1567;
+    }
+    switch (dc->tiff_data_compression) {
       case 0:				/* No compression */
       case 1:
-	rgb_max = 0x3fc0;
-	load_raw = kodak_easy_load_raw;  break;
+	dc->rgb_max = 0x3fc0;
+	dc->load_raw = kodak_easy_load_raw;  break;
       case 7:				/* Lossless JPEG */
-	load_raw = lossless_jpeg_load_raw;  break;
+	dc->load_raw = lossless_jpeg_load_raw;  break;
       case 65000:			/* Kodak DCR compression */
-	black = 0;
-	if (kodak_data_compression == 32803)
-	  load_raw = kodak_compressed_load_raw;
+	dc->black = 0;
+	if (dc->kodak_data_compression == 32803)
+	  dc->load_raw = kodak_compressed_load_raw;
 	else {
-	  load_raw = kodak_yuv_load_raw;
-	  filters = 0;
+	  dc->load_raw = kodak_yuv_load_raw;
+	  dc->filters = 0;
 	}
 	break;
       default:
 	fprintf (stderr, "%s: %s %s uses unsupported compression method %d.\n",
-		fname, make, model, tiff_data_compression);
+		fname, dc->make, dc->model, dc->tiff_data_compression);
 	return 1;
     }
-  } else if (!strcmp(make,"Rollei")) {
-    height = raw_height;
-    width = raw_width;
-    filters = 0x16161616;
-    load_raw = rollei_load_raw;
-    pre_mul[0] = 1.8;
-    pre_mul[2] = 1.3;
-  } else if (!strcmp(model,"SD9")) {
-    switch (height = raw_height) {
-      case  763: height =  756;  break;
-      case 1531: height = 1514;  break;
-    }
-    switch (width = raw_width) {
-      case 1152:  width = 1136;  break;
-      case 2304:  width = 2271;  break;
-    }
-    if (height*2 < width) ymag = 2;
-    filters = 0;
-    load_raw = foveon_load_raw;
-    is_foveon = 1;
-    foveon_coeff();
-    rgb_max = 5600;
-  } else if (!strcmp(model,"QV-2000UX")) {
-    height = 1208;
-    raw_width = width = 1632;
-    filters = 0x94949494;
-    tiff_data_offset = width * 2;
-    load_raw = casio_easy_load_raw;
-  } else if (!strcmp(model,"QV-3*00EX")) {
-    height = 1546;
-    width  = 2070;
-    raw_width = 2080;
-    filters = 0x94949494;
-    load_raw = casio_easy_load_raw;
-  } else if (!strcmp(model,"QV-4000")) {
-    height = 1700;
-    width  = 2260;
-    filters = 0x94949494;
-    load_raw = olympus_load_raw;
-  } else if (!strcmp(model,"QV-5700")) {
-    height = 1924;
-    width  = 2576;
-    filters = 0x94949494;
-    load_raw = casio_qv5700_load_raw;
-  } else if (!strcmp(make,"Nucore")) {
-    height = raw_height;
-    width = raw_width;
-    filters = 0x61616161;
-    load_raw = nucore_load_raw;
-  } else {
-    fprintf (stderr, "%s: %s %s is not yet supported.\n",fname, make, model);
-    return 1;
-  }
-#ifndef LJPEG_DECODE
-  if (load_raw == lossless_jpeg_load_raw) {
-    fprintf (stderr, "%s: %s %s requires lossless JPEG decoder.\n",
-	fname, make, model);
-    return 1;
+  } else if (!strcmp(dc->make,"Rollei")) {
+    dc->height = dc->raw_height;
+    dc->width = dc->raw_width;
+    dc->filters = 0x16161616;
+    dc->load_raw = rollei_load_raw;
+    dc->pre_mul[0] = 1.8;
+    dc->pre_mul[2] = 1.3;
+  } else if (!strcmp(dc->model,"SD9")) {
+    switch (dc->height = dc->raw_height) {
+      case  763: dc->height =  756;  break;
+      case 1531: dc->height = 1514;  break;
+    }
+    switch (dc->width = dc->raw_width) {
+      case 1152:  dc->width = 1136;  break;
+      case 2304:  dc->width = 2271;  break;
+    }
+    if (dc->height*2 < dc->width) dc->ymag = 2;
+    dc->filters = 0;
+    dc->load_raw = foveon_load_raw;
+    dc->is_foveon = 1;
+    foveon_coeff(dc);
+    dc->rgb_max = 5600;
+  } else if (!strcmp(dc->model,"QV-2000UX")) {
+    dc->height = 1208;
+    dc->raw_width = dc->width = 1632;
+    dc->filters = 0x94949494;
+    dc->tiff_data_offset = dc->width * 2;
+    dc->load_raw = casio_easy_load_raw;
+  } else if (!strcmp(dc->model,"QV-3*00EX")) {
+    dc->height = 1546;
+    dc->width  = 2070;
+    dc->raw_width = 2080;
+    dc->filters = 0x94949494;
+    dc->load_raw = casio_easy_load_raw;
+  } else if (!strcmp(dc->model,"QV-4000")) {
+    dc->height = 1700;
+    dc->width  = 2260;
+    dc->filters = 0x94949494;
+    dc->load_raw = olympus_load_raw;
+  } else if (!strcmp(dc->model,"QV-5700")) {
+    dc->height = 1924;
+    dc->width  = 2576;
+    dc->filters = 0x94949494;
+    dc->load_raw = casio_qv5700_load_raw;
+  } else if (!strcmp(dc->make,"Nucore")) {
+    dc->height = dc->raw_height;
+    dc->width = dc->raw_width;
+    dc->filters = 0x61616161;
+    dc->load_raw = nucore_load_raw;
+  } else {
+    fprintf (stderr, "%s: %s %s is not yet supported.\n",
+	fname, dc->make, dc->model);
+    return 1;
+  }
+#ifndef LJPEG_DECODE
+  if (dc->load_raw == lossless_jpeg_load_raw) {
+    fprintf (stderr, "%s: %s %s requires lossless JPEG decoder.\n",
+	fname, dc->make, dc->model);
+    return 1;
+  }
+#endif
+  if (dc->use_camera_wb) {
+    if (dc->camera_red && dc->camera_blue && dc->colors == 3) {
+      dc->pre_mul[0] = dc->camera_red;
+      dc->pre_mul[2] = dc->camera_blue;
+    } else
+      fprintf (stderr, "%s: Cannot use camera white balance.\n",fname);
+  }
+  if (dc->colors == 4 && !dc->use_coeff)
+    gmcy_coeff(dc);
+  if (dc->use_coeff)		 /* Apply user-selected color balance */
+    for (i=0; i < dc->colors; i++) {
+      dc->coeff[0][i] *= dc->red_scale;
+      dc->coeff[2][i] *= dc->blue_scale;
+    }
+  else {
+    dc->pre_mul[0] *= dc->red_scale;
+    dc->pre_mul[2] *= dc->blue_scale;
+  }
+  if (dc->four_color_rgb && dc->filters && dc->colors == 3) {
+    for (i=0; i < 32; i+=4) {
+      if ((dc->filters >> i & 15) == 9)
+	dc->filters |= 2 << i;
+      if ((dc->filters >> i & 15) == 6)
+	dc->filters |= 8 << i;
+    }
+    dc->colors++;
+    if (dc->use_coeff)
+      for (i=0; i < 3; i++)
+	dc->coeff[i][3] = dc->coeff[i][1] /= 2;
+  }
+  for (i=0; i < 16; i++)
+    dc->fcol[i >> 1][i & 1] = dc->filters >> (i << 1) & 3;
+  return 0;
+}
+
+#ifndef NO_MAIN
+/*
+   Give a second struct dcraw the options set in the first.
+ */
+static void copy_options (struct dcraw *to, const struct dcraw *from)
+{
+  to->gamma_val = from->gamma_val;
+  to->bright = from->bright;
+  to->red_scale = from->red_scale;
+  to->blue_scale = from->blue_scale;
+  to->four_color_rgb = from->four_color_rgb;
+  to->use_camera_wb = from->use_camera_wb;
+  to->document_mode = from->document_mode;
+  to->quick_interpolate = from->quick_interpolate;
+  to->edge_interpolate = from->edge_interpolate;
+  to->use_ahd = from->use_ahd;
+  to->stream_mode = from->stream_mode;
+  to->thumbnail_only = from->thumbnail_only;
+  to->hot_ratio = from->hot_ratio;
+  to->dark_name = from->dark_name;
+  to->nthreads = from->nthreads;
+  to->sample_rows = from->sample_rows;
+  to->huge_pages = from->huge_pages;
+  to->mem_limit = from->mem_limit;
+  to->write_fun = from->write_fun;
+}
+
+struct dark {
+  struct dcraw_dark_head *dh;
+  char **files;			/* The frames that fit */
+  struct dcraw *dc[MAX_THREADS];
+  unsigned *sum[MAX_THREADS];
+  int frames[MAX_THREADS];
+};
+
+/*
+   Load frames top through bottom-1 of the list, adding them into
+   this band's sums.
+ */
+static void dark_band (struct dcraw *unused, void *arg, int band, int top,
+	int bottom)
+{
+  struct dark *dk = arg;
+  struct dcraw *dc = dk->dc[band];
+  unsigned *sum = dk->sum[band];
+  int i, row, col;
+
+  for (i=top; i < bottom; i++) {
+    if (!(dc->ifp = fopen (dk->files[i], "rb"))) {
+      perror (dk->files[i]);
+      continue;
+    }
+    if (!identify (dc, dk->files[i]) && dc->width == dk->dh->width &&
+	dc->height == dk->dh->height && dc->filters == dk->dh->filters) {
+      dc->raw_image = get_block (dc, &dc->plane,
+		dc->width * dc->height * 2, 0);
+      memset (dc->raw_image, 0, dc->width * dc->height * 2);
+      fprintf (stderr, "Loading dark frame %s...\n", dk->files[i]);
+      (*dc->load_raw)(dc);
+      for (row=0; row < dc->height; row++)
+	for (col=0; col < dc->width; col++)
+	  sum[row*dc->width+col] += BAYER(row,col);
+      dc->raw_image = 0;
+      dk->frames[band]++;
+    }
+    fclose(dc->ifp);
+    dc->ifp = 0;
+  }
+}
+
+/*
+   Average the named raw files into the master dark frame "dname".
+   The files are checked against the first one in order, then loaded
+   in bands of the list, each band with its own struct dcraw and its
+   own sums.  Return nonzero on failure.
+ */
+static int make_dark (struct dcraw *dc, char *dname, int nfiles, char **files)
+{
+  struct dcraw_dark_head dh;
+  struct dark dk;
+  unsigned *sum;
+  ushort *avg;
+  int i, j, n, nfit=0, npix=0;
+  FILE *ofp;
+
+  memset (&dh, 0, sizeof dh);
+  memset (&dk, 0, sizeof dk);
+  dk.dh = &dh;
+  dk.files = malloc (nfiles * sizeof *dk.files);
+  merror (dk.files, "make_dark()");
+  for (i=0; i < nfiles; i++) {
+    if (!(dc->ifp = fopen (files[i], "rb"))) {
+      perror (files[i]);
+      continue;
+    }
+    if (identify (dc, files[i])) {
+      fclose(dc->ifp);
+      continue;
+    }
+    if (!dc->filters) {
+      fprintf (stderr, "%s: Dark frames must be raw CFA data.\n", files[i]);
+      fclose(dc->ifp);
+      continue;
+    }
+    if (!nfit) {
+      memcpy (dh.magic, "DCRAWDK1", 8);
+      dh.byte_order = 0x01020304;
+      dh.width = dc->width;
+      dh.height = dc->height;
+      dh.filters = dc->filters;
+      sprintf (dh.model, "%.35s", dc->model);
+      npix = dc->width * dc->height;
+    } else if (dc->width != dh.width || dc->height != dh.height ||
+		dc->filters != dh.filters) {
+      fprintf (stderr, "%s: %s %s does not match the first dark frame.\n",
+		files[i], dc->make, dc->model);
+      fclose(dc->ifp);
+      continue;
+    }
+    fclose(dc->ifp);
+    dk.files[nfit++] = files[i];
   }
-#endif
-  if (use_camera_wb) {
-    if (camera_red && camera_blue && colors == 3) {
-      pre_mul[0] = camera_red;
-      pre_mul[2] = camera_blue;
+  dc->ifp = 0;
+  n = nfit < nworkers(dc) ? nfit : nworkers(dc);
+  if (dc->mem_limit && npix && n > dc->mem_limit / ((INT64) npix * 6))
+    n = dc->mem_limit / ((INT64) npix * 6);
+  if (n < 1) n = 1;
+  for (i=0; i < n; i++) {
+    if (i) {
+      dk.dc[i] = dcraw_new();
+      merror (dk.dc[i], "make_dark()");
+      copy_options (dk.dc[i], dc);
     } else
-      fprintf (stderr, "%s: Cannot use camera white balance.\n",fname);
+      dk.dc[i] = dc;
+    dk.sum[i] = calloc (npix, sizeof *sum);
+    merror (dk.sum[i], "make_dark()");
   }
-  if (colors == 4 && !use_coeff)
-    gmcy_coeff();
-  if (use_coeff)		 /* Apply user-selected color balance */
-    for (i=0; i < colors; i++) {
-      coeff[0][i] *= red_scale;
-      coeff[2][i] *= blue_scale;
-    }
-  else {
-    pre_mul[0] *= red_scale;
-    pre_mul[2] *= blue_scale;
+  run_split (dc, dark_band, &dk, 0, nfit, n);
+  sum = dk.sum[0];
+  for (i=1; i < n; i++) {
+    for (j=0; j < npix; j++)
+      sum[j] += dk.sum[i][j];
+    free (dk.sum[i]);
+    dcraw_free (dk.dc[i]);
   }
-  if (four_color_rgb && filters && colors == 3) {
-    for (i=0; i < 32; i+=4) {
-      if ((filters >> i & 15) == 9)
-	filters |= 2 << i;
-      if ((filters >> i & 15) == 6)
-	filters |= 8 << i;
-    }
-    colors++;
-    if (use_coeff)
-      for (i=0; i < 3; i++)
-	coeff[i][3] = coeff[i][1] /= 2;
+  for (i=0; i < n; i++)
+    dh.frames += dk.frames[i];
+  free (dk.files);
+  if (!dh.frames) {
+    fprintf (stderr, "No dark frames were loaded.\n");
+    free (sum);
+    return 1;
+  }
+  avg = (ushort *) sum;			/* Average in place */
+  for (i=0; i < npix; i++)
+    avg[i] = (sum[i] + dh.frames/2) / dh.frames;
+  if (!(ofp = fopen (dname, "wb"))) {
+    perror (dname);
+    free (sum);
+    return 1;
   }
+  fprintf (stderr, "Writing average of %d dark frames to %s...\n",
+	dh.frames, dname);
+  fwrite (&dh, sizeof dh, 1, ofp);
+  fwrite (avg, sizeof *avg, npix, ofp);
+  fclose (ofp);
+  free (sum);
   return 0;
 }
+#endif
 
 /*
-   Convert the entire image to RGB colorspace and build a histogram.
+   Convert rows top through bottom-1 to RGB colorspace, counting
+   them in the histogram for this band.  Except in Document Mode,
+   every conversion is a 3x4 matrix, applied to a whole row at once.
  */
-void convert_to_rgb()
+static void convert_band (struct dcraw *dc, void *arg, int band, int top,
+	int bottom)
 {
-  int row, col, r, g, c=0;
+  int (*hist)[0x2000] = arg;
+  int row, col, r, c, n, val;
   ushort *img;
-  float rgb[4];
-
-  if (document_mode)
-    colors = 1;
-  memset (histogram, 0, sizeof histogram);
-  for (row = trim; row < height-trim; row++)
-    for (col = trim; col < width-trim; col++) {
-      img = image[row*width+col];
-      if (document_mode)
-	c = FC(row,col);
-      if (colors == 4 && !use_coeff)	/* Recombine the greens */
-	img[1] = (img[1] + img[3]) >> 1;
-      if (colors == 1)			/* RGB from grayscale */
-	for (r=0; r < 3; r++)
-	  rgb[r] = img[c];
-      else if (use_coeff) {		/* RGB from GMCY or Foveon */
-	for (r=0; r < 3; r++)
-	  for (rgb[r]=g=0; g < colors; g++)
-	    rgb[r] += img[g] * coeff[r][g];
-      } else if (is_cmy) {		/* RGB from CMY */
-	rgb[0] = img[0] + img[1] - img[2];
-	rgb[1] = img[1] + img[2] - img[0];
-	rgb[2] = img[2] + img[0] - img[1];
-      } else				/* RGB from RGB (easy) */
+  float mat[3][4], (*rgb)[4], *pix;
+
+  memset (mat, 0, sizeof mat);
+  for (r=0; r < 3; r++)
+    if (dc->colors == 1)			/* RGB from grayscale */
+      mat[r][0] = 1;
+    else if (dc->use_coeff)			/* RGB from GMCY or Foveon */
+      for (c=0; c < dc->colors; c++)
+	mat[r][c] = dc->coeff[r][c];
+    else if (dc->is_cmy) {			/* RGB from CMY */
+      mat[r][r] = mat[r][(r+1) % 3] = 1;
+      mat[r][(r+2) % 3] = -1;
+    } else				/* RGB from RGB (easy) */
+      mat[r][r] = 1;
+  n = dc->width - dc->trim*2;
+  rgb = malloc (n * sizeof *rgb);
+  merror (rgb, "convert_to_rgb()");
+  for (row=top; row < bottom && !dc->cancelled; row++) {
+    img = dc->image[row*dc->width+dc->trim];
+    if (dc->document_mode)		/* Grayscale, white balanced */
+      for (col=0; col < n; col++, img+=4) {
+	c = FC(row,col+dc->trim);
+	val = img[c];
+	val *= dc->pre_mul[c];
+	rgb[col][0] = rgb[col][1] = rgb[col][2] = val;
+      }
+    else {
+      if (dc->colors == 4 && !dc->use_coeff)	/* Recombine the greens */
+	for (col=0; col < n; col++)
+	  img[col*4+1] = (img[col*4+1] + img[col*4+3]) >> 1;
+      for (col=0; col < n; col++, img+=4)
 	for (r=0; r < 3; r++)
-	  rgb[r] = img[r];
-      for (rgb[3]=r=0; r < 3; r++) {	/* Compute the magnitude */
-	if (rgb[r] < 0) rgb[r] = 0;
-	if (rgb[r] > rgb_max) rgb[r] = rgb_max;
-	rgb[3] += rgb[r]*rgb[r];
+	  rgb[col][r] = mat[r][0]*img[0] + mat[r][1]*img[1]
+		      + mat[r][2]*img[2] + mat[r][3]*img[3];
+    }
+    img = dc->image[row*dc->width+dc->trim];
+    for (col=0; col < n; col++, img+=4) {
+      pix = rgb[col];
+      for (pix[3]=r=0; r < 3; r++) {	/* Compute the magnitude */
+	if (pix[r] < 0) pix[r] = 0;
+	if (pix[r] > dc->rgb_max) pix[r] = dc->rgb_max;
+	pix[3] += pix[r]*pix[r];
       }
-      rgb[3] = sqrt(rgb[3])/2;
-      if (rgb[3] > 0xffff) rgb[3] = 0xffff;
+      pix[3] = sqrt(pix[3])/2;
+      if (pix[3] > 0xffff) pix[3] = 0xffff;
       for (r=0; r < 4; r++)
-	img[r] = rgb[r];
-      histogram[img[3] >> 3]++;		/* bin width is 8 */
+	img[r] = pix[r];
+      hist[band][img[3] >> 3]++;	/* bin width is 8 */
     }
+  }
+  free (rgb);
 }
 
 /*
-   Write the image to a 24-bit PPM file.
+   Convert rows top through bottom-1 to RGB colorspace, adding them
+   to the histogram.
  */
-void write_ppm(FILE *ofp)
+static void convert_rows (struct dcraw *dc, int top, int bottom)
 {
-  int row, col, i, c, val, total;
-  float max, mul, scale;
-  ushort *rgb;
-  uchar (*ppm)[3];
+  int (*hist)[0x2000], n, i, val;
+
+  if (dc->document_mode)
+    dc->colors = 1;
+  n = nbands (dc, bottom - top);
+  hist = calloc (n, sizeof *hist);
+  merror (hist, "convert_to_rgb()");
+  run_bands (dc, convert_band, hist, top, bottom);
+  for (i=0; i < n; i++)
+    for (val=0; val < 0x2000; val++)
+      dc->histogram[val] += hist[i][val];
+  free (hist);
+}
+
+/*
+   Convert the entire image to RGB colorspace and build a histogram.
+ */
+static void convert_to_rgb(struct dcraw *dc)
+{
+  memset (dc->histogram, 0, sizeof dc->histogram);
+  convert_rows (dc, dc->trim, dc->height-dc->trim);
+}
+
+/*
+   All output goes through here, to the callback given to
+   dcraw_write_cb() if there is one, otherwise to ofp.  A callback
+   that takes less than it is given stops the decode.
+ */
+static void put_out (struct dcraw *dc, FILE *ofp, const void *data, size_t len)
+{
+  if (dc->out) {
+    if ((*dc->out)(dc->out_arg, data, len) < len)
+      dc->cancelled = 1;
+  } else
+    fwrite (data, 1, len, ofp);
+}
+
+/*
+   Copy the embedded JPEG preview straight from the raw file.
+ */
+void dcraw_write_thumb(struct dcraw *dc, FILE *ofp)
+{
+  char buf[0x8000];
+  int len, n;
+
+  fseek (dc->ifp, dc->thumb_offset, SEEK_SET);
+  for (len=dc->thumb_length; len > 0; len -= n) {
+    n = len < sizeof buf ? len : sizeof buf;
+    if ((n = fread (buf, 1, n, dc->ifp)) < 1) break;
+    put_out (dc, ofp, buf, n);
+  }
+}
+
+/*
+   The PPM writers are split into a header and runs of rows, so that
+   stream_image() can hand them the image a band at a time.
+ */
+static void ppm_head (struct dcraw *dc, FILE *ofp, int maxval, int mag)
+{
+  char head[64];
+
+  sprintf (head, "P6\n%d %d\n%d\n",
+	dc->width-dc->trim*2, mag*(dc->height-dc->trim*2), maxval);
+  put_out (dc, ofp, head, strlen(head));
+}
 
 /*
    Set the white point to the 99th percentile
  */
+static float white_point(struct dcraw *dc)
+{
+  int val, total;
+
   for (val=0x2000, total=0; --val; )
-    if ((total+=histogram[val]) > (int)(width*height*0.01)) break;
-  max = val << 4;
+    if ((total+=dc->histogram[val]) > (int)(dc->width*dc->height*0.01)) break;
+  return val << 4;
+}
 
-  fprintf (ofp, "P6\n%d %d\n255\n",
-	width-trim*2, ymag*(height-trim*2));
+static void ppm_rows (struct dcraw *dc, FILE *ofp, int top, int bottom,
+	float max)
+{
+  int row, col, i, c, val;
+  float mul, scale;
+  ushort *rgb;
+  uchar (*ppm)[3];
 
-  ppm = calloc (width-trim*2, 3);
+  ppm = calloc (dc->width-dc->trim*2, 3);
   merror (ppm, "write_ppm()");
-  mul = bright * 442 / max;
+  mul = dc->bright * 442 / max;
 
-  for (row=trim; row < height-trim; row++) {
-    for (col=trim; col < width-trim; col++) {
-      rgb = image[row*width+col];
+  for (row=top; row < bottom; row++) {
+    for (col=dc->trim; col < dc->width-dc->trim; col++) {
+      rgb = dc->image[row*dc->width+col];
 /* In some math libraries, pow(0,expo) doesn't return zero */
-      scale = rgb[3] ? mul * pow (rgb[3]*2/max, gamma_val-1) : 0;
+      scale = rgb[3] ? mul * pow (rgb[3]*2/max, dc->gamma_val-1) : 0;
       for (c=0; c < 3; c++) {
 	val = rgb[c] * scale;
 	if (val > 255) val=255;
-	ppm[col-trim][c] = val;
+	ppm[col-dc->trim][c] = val;
       }
     }
-    for (i=0; i < ymag; i++)
-      fwrite (ppm, width-trim*2, 3, ofp);
+    for (i=0; i < dc->ymag; i++)
+      put_out (dc, ofp, ppm, (dc->width-dc->trim*2) * 3);
   }
   free(ppm);
 }
 
+/*
+   Write the image to a 24-bit PPM file.
+ */
+void dcraw_write_ppm(struct dcraw *dc, FILE *ofp)
+{
+  ppm_head (dc, ofp, 255, dc->ymag);
+  ppm_rows (dc, ofp, dc->trim, dc->height-dc->trim, white_point(dc));
+}
+
 /*
    Write the image to a 48-bit Photoshop file.
  */
-void write_psd(FILE *ofp)
+void dcraw_write_psd(struct dcraw *dc, FILE *ofp)
 {
   char head[] = {
     '8','B','P','S',		/* signature */
@@ -2847,65 +4570,634 @@ void write_psd(FILE *ofp)
   int hw[2], psize, row, col, c, val;
   ushort *buffer, *pred, *rgb;
 
-  hw[0] = htonl(height-trim*2);	/* write the header */
-  hw[1] = htonl(width-trim*2);
+  hw[0] = htonl(dc->height-dc->trim*2);	/* write the header */
+  hw[1] = htonl(dc->width-dc->trim*2);
   memcpy (head+14, hw, sizeof hw);
-  fwrite (head, 40, 1, ofp);
+  put_out (dc, ofp, head, 40);
 
-  psize = (height-trim*2) * (width-trim*2);
-  buffer = calloc (6, psize);
-  merror (buffer, "write_psd()");
+  psize = (dc->height-dc->trim*2) * (dc->width-dc->trim*2);
+  buffer = get_block (dc, &dc->scratch, psize * 6, 0);
   pred = buffer;
 
-  for (row = trim; row < height-trim; row++) {
-    for (col = trim; col < width-trim; col++) {
-      rgb = image[row*width+col];
+  for (row = dc->trim; row < dc->height-dc->trim; row++) {
+    for (col = dc->trim; col < dc->width-dc->trim; col++) {
+      rgb = dc->image[row*dc->width+col];
       for (c=0; c < 3; c++) {
-	val = rgb[c] * bright;
+	val = rgb[c] * dc->bright;
 	if (val > 0xffff) val=0xffff;
 	pred[c*psize] = htons(val);
       }
       pred++;
     }
   }
-  fwrite(buffer, psize, 6, ofp);
-  free(buffer);
+  put_out (dc, ofp, buffer, psize * 6);
 }
 
-/*
-   Write the image to a 48-bit PPM file.
- */
-void write_ppm16(FILE *ofp)
+static void ppm16_rows (struct dcraw *dc, FILE *ofp, int top, int bottom)
 {
   int row, col, c, val;
   ushort *rgb, (*ppm)[3];
 
-  fprintf (ofp, "P6\n%d %d\n65535\n",
-	width-trim*2, height-trim*2);
-
-  ppm = calloc (width-trim*2, 6);
+  ppm = calloc (dc->width-dc->trim*2, 6);
   merror (ppm, "write_ppm16()");
 
-  for (row = trim; row < height-trim; row++) {
-    for (col = trim; col < width-trim; col++) {
-      rgb = image[row*width+col];
+  for (row = top; row < bottom; row++) {
+    for (col = dc->trim; col < dc->width-dc->trim; col++) {
+      rgb = dc->image[row*dc->width+col];
       for (c=0; c < 3; c++) {
-	val = rgb[c] * bright;
+	val = rgb[c] * dc->bright;
 	if (val > 0xffff) val=0xffff;
-	ppm[col-trim][c] = htons(val);
+	ppm[col-dc->trim][c] = htons(val);
       }
     }
-    fwrite (ppm, width-trim*2, 6, ofp);
+    put_out (dc, ofp, ppm, (dc->width-dc->trim*2) * 6);
   }
   free(ppm);
 }
 
-int main(int argc, char **argv)
+/*
+   Write the image to a 48-bit PPM file.
+ */
+void dcraw_write_ppm16(struct dcraw *dc, FILE *ofp)
+{
+  ppm_head (dc, ofp, 65535, 1);
+  ppm16_rows (dc, ofp, dc->trim, dc->height-dc->trim);
+}
+
+/*
+   Spread rows top through bottom-1 of the raw samples out into buf[],
+   as expand_raw() would.
+ */
+static void fill_band (struct dcraw *dc, ushort (*buf)[4], int top, int bottom)
+{
+  ushort *pix;
+  int row, col;
+
+  memset (buf, 0, (bottom-top) * dc->width * sizeof *buf);
+  for (row=top; row < bottom; row++) {
+    pix = buf[(row-top)*dc->width];
+    for (col=0; col < dc->width; col++, pix+=4)
+      pix[FC(row,col)] = dc->raw_image[row*dc->width+col];
+  }
+}
+
+/*
+   Interpolate, convert and write the image a band of rows at a time,
+   so only the raw samples and one band of pixels are held at once.
+   Each band is read with eight more rows on either side, enough for
+   every interpolation to do its rows just as in the whole image, and
+   starts on a multiple of eight rows so that FC() still holds.  While
+   a band is done, image[] and height describe it alone.  The
+   histogram for the 24-bit white point comes from a first pass over
+   one band of 32 rows in every sample_rows.
+ */
+static void stream_image (struct dcraw *dc, FILE *ofp)
+{
+  ushort (*buf)[4];
+  int full=dc->height, rows, step, top, btop, bbot, first, last, pass, band;
+  int sampled=0;
+  float max=0, scale;
+
+  rows = dc->band_rows ? dc->band_rows : nbands(dc, dc->height) * 128;
+  buf = get_block (dc, &dc->scratch,
+	(MAX(rows,32) + 16) * dc->width * sizeof *buf, 0);
+  memset (dc->histogram, 0, sizeof dc->histogram);
+  for (pass = dc->write_fun != dcraw_write_ppm; pass < 2; pass++) {
+    if (pass) {
+      if (dc->write_fun == dcraw_write_ppm) {
+	scale = (float) (full - dc->trim*2) / sampled;
+	for (band=0; band < 0x2000; band++)
+	  dc->histogram[band] = dc->histogram[band] * scale + 0.5;
+	max = white_point(dc);
+	ppm_head (dc, ofp, 255, dc->ymag);
+      } else
+	ppm_head (dc, ofp, 65535, 1);
+    }
+    step = pass ? rows : 32;
+    for (band=0, top=0; top < full; top += step, band++) {
+      if (!pass && band % dc->sample_rows) continue;
+      if (pass ? progress (dc, DCRAW_WRITE, top, full) : dc->cancelled)
+	break;
+      btop = top < 8 ? 0 : top-8;
+      bbot = top+step+8 < full ? top+step+8 : full;
+      first = (top > dc->trim ? top : dc->trim) - btop;
+      last = (top+step < full-dc->trim ? top+step : full-dc->trim) - btop;
+      fill_band (dc, buf, btop, bbot);
+      dc->image = buf;
+      dc->height = bbot - btop;
+      if (dc->trim) vng_interpolate(dc);
+      convert_rows (dc, first, last);
+      if (!pass)
+	sampled += last - first;
+      else if (dc->write_fun == dcraw_write_ppm)
+	ppm_rows (dc, ofp, first, last, max);
+      else
+	ppm16_rows (dc, ofp, first, last);
+      dc->height = full;
+    }
+  }
+  dc->image = 0;
+}
+
+/*
+   Decide how to decode an image of this size in mem_limit bytes:
+   whole if it fits, otherwise streamed, with shorter bands and then
+   fewer threads until the band buffer and each thread's scratch fit
+   beside the raw plane.  Returns 1 to stream, 0 to decode the whole
+   image, or -1 if neither will fit.
+ */
+static int fit_memory (struct dcraw *dc, int stream)
+{
+  INT64 pixels = (INT64) dc->height * dc->width, fixed, scratch, need, rows;
+  int n;
+
+  fixed = (4 << 20) + dc->raw_width * 16;	/* tables, loader rows */
+  if (dc->dark_name) fixed += pixels * 2;
+  if (dc->is_foveon) fixed += pixels * 30 / 16;
+  scratch = 0x2000 * sizeof *dc->histogram +
+	(dc->use_ahd ? 26*TS*TS : cache_size()/2);
+  need = fixed + pixels * (dc->filters || dc->colors == 1 ? 10 : 8)
+	+ nbands(dc, dc->height) * scratch;
+  if (!(dc->filters || dc->colors == 1) ||
+	(dc->write_fun != dcraw_write_ppm && dc->write_fun != dcraw_write_ppm16))
+    return need > dc->mem_limit ? -1 : 0;
+  if (!stream && need <= dc->mem_limit) return 0;
+  for (n = nbands(dc, dc->height); n; n--) {
+    rows = (dc->mem_limit - fixed - pixels*2 - n*scratch) / (dc->width*8) - 16;
+    if (rows > n*128) rows = n*128;
+    rows &= -8;
+    if (rows >= 32 && rows >= n*16) {
+      dc->band_threads = n;
+      dc->band_rows = rows;
+      return 1;
+    }
+  }
+  return -1;
+}
+
+#ifndef NO_MAIN
+/*
+   Read a size in megabytes, or in other units with a K, M or G suffix.
+ */
+static INT64 parse_size (char *str)
+{
+  char *cp;
+  double size = strtod (str, &cp);
+
+  switch (*cp | 32) {
+    case 'g':  size *= 1024;
+    case 'm':  size *= 1024;
+    case 'k':  size *= 1024;
+      break;
+    default:   size *= 1 << 20;
+  }
+  return size;
+}
+#endif
+
+/*
+   Return a struct dcraw with the default options and nothing loaded,
+   or NULL if there is no memory for one.
+ */
+struct dcraw *dcraw_new (void)
+{
+  struct dcraw *dc = calloc (1, sizeof *dc);
+
+  if (!dc) return 0;
+  dc->gamma_val = 0.8;
+  dc->bright = dc->red_scale = dc->blue_scale = 1.0;
+  dc->sample_rows = 1;
+  dc->write_fun = dcraw_write_ppm;
+  dc->nbadpix = -1;
+  dc->fix_key[0] = -1;
+  return dc;
+}
+
+void dcraw_free (struct dcraw *dc)
+{
+  if (!dc) return;
+  dcraw_close (dc);
+  if (dc->dark_head) close_view (&dc->dark_view);
+  free (dc->badpix);
+  free (dc->badpix_dir);
+  free (dc->fix);
+  free (dc->fixval);
+  free_block (&dc->plane);
+  free_block (&dc->scratch);
+  free (dc);
+}
+
+/*
+   Let go of the image and its input so that another can be opened.
+   The memory they were in is kept for the next one, unless there
+   is a limit on memory to keep to.
+ */
+void dcraw_close (struct dcraw *dc)
+{
+  if (dc->ifp) fclose (dc->ifp);
+  free (dc->ifname);
+  if (dc->mem_limit) {		/* The next image may be streamed */
+    free_block (&dc->plane);
+    free_block (&dc->scratch);
+  }
+  dc->ifp = 0;
+  dc->ifname = 0;
+  dc->raw_image = 0;
+  dc->image = 0;
+  dc->stream = dc->band_rows = dc->band_threads = 0;
+  dc->cancelled = 0;
+}
+
+static int open_input (struct dcraw *dc, FILE *fp, const char *name)
+{
+  if (!fp) return 1;
+  if (!name) name = "input";
+  dc->ifp = fp;
+  dc->ifname = malloc (strlen(name) + 1);
+  merror (dc->ifname, "open_input()");
+  strcpy (dc->ifname, name);
+  return 0;
+}
+
+/*
+   Each of these returns zero on success, otherwise nonzero with
+   errno set.
+ */
+int dcraw_open (struct dcraw *dc, const char *fname)
+{
+  dcraw_close (dc);
+  return open_input (dc, fopen (fname, "rb"), fname);
+}
+
+int dcraw_open_fd (struct dcraw *dc, int fd, const char *name)
+{
+  FILE *fp;
+
+  dcraw_close (dc);
+  if ((fd = dup(fd)) < 0) return 1;
+  if (!(fp = fdopen (fd, "rb"))) close (fd);
+  return open_input (dc, fp, name);
+}
+
+/*
+   The buffer is read in place, so it must stay put until the raw
+   data has been loaded (or, for -e, until the preview is written).
+ */
+int dcraw_open_buffer (struct dcraw *dc, const void *data, size_t size,
+	const char *name)
+{
+  dcraw_close (dc);
+#ifdef WIN32
+  errno = ENOSYS;
+  return 1;
+#else
+  return open_input (dc, fmemopen ((void *) data, size, "r"), name);
+#endif
+}
+
+int dcraw_identify (struct dcraw *dc)
+{
+  return identify (dc, dc->ifname);
+}
+
+/*
+   Read the raw data, then close the input.
+ */
+int dcraw_load_raw (struct dcraw *dc)
+{
+  size_t size;
+
+  dc->stream = dc->stream_mode;
+  if (dc->mem_limit && (dc->stream = fit_memory (dc, dc->stream_mode)) < 0) {
+    fprintf (stderr, "%s will not fit in %d MB of memory.\n",
+	dc->ifname, (int) (dc->mem_limit >> 20));
+    return 1;
+  }
+  if (progress (dc, DCRAW_LOAD, 0, 1)) return 1;
+  size = (size_t) dc->height * dc->width;
+  size *= dc->filters || dc->colors == 1 ?
+	sizeof *dc->raw_image : sizeof *dc->image;
+  memset (get_block (dc, &dc->plane, size, 0), 0, size);
+  if (dc->filters || dc->colors == 1)
+    dc->raw_image = dc->plane.mem;
+  else
+    dc->image = dc->plane.mem;
+  (*dc->load_raw)(dc);
+  fclose (dc->ifp);
+  dc->ifp = 0;
+  return progress (dc, DCRAW_LOAD, 1, 1);
+}
+
+/*
+   Subtract the dark frame, fix bad pixels and scale to white
+   balance, or for Foveon, do all of that and the interpolation.
+ */
+int dcraw_preprocess (struct dcraw *dc)
+{
+  ushort *dark;
+
+  if (progress (dc, DCRAW_PREPROCESS, 0, 1)) return 1;
+  if (dc->is_foveon)
+    foveon_interpolate(dc);
+  else {
+    dark = dc->dark_name ? load_dark(dc) : 0;
+    if (dc->hot_ratio > 0) {
+      if (dark) subtract_dark (dc, dark);
+      dark = 0;
+      find_bad_pixels (dc, dc->ifname);
+    }
+    preprocess (dc, dark);
+  }
+  return progress (dc, DCRAW_PREPROCESS, 1, 1);
+}
+
+/*
+   When streaming, this and dcraw_convert() only decide what
+   dcraw_write() will do a band at a time.
+ */
+int dcraw_interpolate (struct dcraw *dc)
+{
+  if (progress (dc, DCRAW_INTERPOLATE, 0, 1)) return 1;
+  dc->stream = dc->stream && dc->raw_image &&
+	(dc->write_fun == dcraw_write_ppm || dc->write_fun == dcraw_write_ppm16);
+  if (dc->raw_image && !dc->stream)
+    expand_raw(dc);
+  dc->trim = 0;
+  if (dc->filters && !dc->document_mode) {
+    dc->trim = 1;
+    if (!dc->stream) vng_interpolate(dc);
+  }
+  return progress (dc, DCRAW_INTERPOLATE, 1, 1);
+}
+
+int dcraw_convert (struct dcraw *dc)
+{
+  if (progress (dc, DCRAW_CONVERT, 0, 1)) return 1;
+  if (!dc->stream) convert_to_rgb(dc);
+  return progress (dc, DCRAW_CONVERT, 1, 1);
+}
+
+int dcraw_write (struct dcraw *dc, FILE *ofp)
+{
+  if (progress (dc, DCRAW_WRITE, 0, dc->height)) return 1;
+  if (dc->stream)
+    stream_image (dc, ofp);
+  else
+    (*dc->write_fun)(dc, ofp);
+  return progress (dc, DCRAW_WRITE, dc->height, dc->height);
+}
+
+/*
+   Write through out(), which returns how much it took.
+ */
+int dcraw_write_cb (struct dcraw *dc,
+	size_t (*out)(void *arg, const void *data, size_t len), void *arg)
+{
+  int ret;
+
+  dc->out = out;
+  dc->out_arg = arg;
+  ret = dcraw_write (dc, 0);
+  dc->out = 0;
+  dc->out_arg = 0;
+  return ret;
+}
+
+struct membuf {
+  char *data;
+  size_t size, alloc;
+};
+
+static size_t append_out (void *arg, const void *data, size_t len)
+{
+  struct membuf *mb = arg;
+  char *grown;
+
+  if (mb->size + len > mb->alloc) {
+    mb->alloc = (mb->size + len) * 2;
+    if (!(grown = realloc (mb->data, mb->alloc))) return 0;
+    mb->data = grown;
+  }
+  memcpy (mb->data + mb->size, data, len);
+  mb->size += len;
+  return len;
+}
+
+/*
+   Write into a buffer allocated with malloc(), for the caller to
+   free().
+ */
+int dcraw_write_buffer (struct dcraw *dc, void **data, size_t *size)
+{
+  struct membuf mb = { 0, 0, 0 };
+  int ret;
+
+  ret = dcraw_write_cb (dc, append_out, &mb);
+  if (ret) {
+    free (mb.data);
+    mb.data = 0;
+    mb.size = 0;
+  }
+  *data = mb.data;
+  *size = mb.size;
+  return ret;
+}
+
+/*
+   Stop the decode under way, from any thread.  The stage running
+   returns nonzero as soon as it notices, and so do those after it.
+ */
+void dcraw_cancel (struct dcraw *dc)
+{
+  dc->cancelled = 1;
+}
+
+#ifndef NO_MAIN
+/*
+   What main() does with each file, in three stages:  load_file()
+   identifies and loads it, process_file() takes it as far as RGB,
+   and write_file() writes it out and lets it go.
+ */
+struct batch {
+  char **files;
+  int nfiles;
+  int write_to_files;
+  const char *write_ext;
+  char *out_name;		/* From -o */
+};
+
+int load_file (struct dcraw *dc, char *fname)
+{
+  if (dcraw_open (dc, fname)) {
+    perror (fname);
+    return 1;
+  }
+  if (dcraw_identify(dc)) goto fail;
+  if (dc->thumbnail_only) {
+    if (dc->thumb_length) return 0;
+    fprintf (stderr, "%s has no embedded preview.\n", fname);
+    goto fail;
+  }
+  fprintf (stderr, "Loading %s %s image from %s...\n",
+	dc->make, dc->model, fname);
+  if (!dcraw_load_raw(dc)) return 0;
+fail:
+  dcraw_close(dc);
+  return 1;
+}
+
+void process_file (struct dcraw *dc)
+{
+  if (dc->thumbnail_only) return;
+  if (dc->is_foveon)
+    fprintf (stderr, "Foveon interpolation...\n");
+  dcraw_preprocess(dc);
+  if (dc->filters && !dc->document_mode)
+    fprintf (stderr, "%s interpolation...\n",
+	dc->quick_interpolate ? "Bilinear" : !bayer_pattern(dc) ? "VNG" :
+	dc->use_ahd ? "AHD" : dc->edge_interpolate ? "Edge-directed":"VNG");
+  dcraw_interpolate(dc);
+  fprintf (stderr, "Converting to RGB colorspace...\n");
+  dcraw_convert(dc);
+}
+
+void write_file (struct dcraw *dc, struct batch *bp, char *fname)
 {
   char data[256], *cp;
-  int arg, id, identify_only=0, write_to_files=1, minuso=0;
+  FILE *ofp = stdout;
+
+  strcpy (data, "standard output");
+  if (bp->write_to_files) {
+    strcpy (data, fname);
+    if ((cp = strrchr (data, '.'))) *cp = 0;
+    strcat (data, bp->write_ext);
+    if (bp->out_name)
+      strcpy (data, bp->out_name);
+    ofp = fopen (data, "wb");
+    if (!ofp) {
+      perror(data);
+      dcraw_close(dc);
+      return;
+    }
+  }
+  fprintf (stderr, "Writing data to %s...\n", data);
+  dcraw_write (dc, ofp);
+  if (bp->write_to_files)
+    fclose(ofp);
+  dcraw_close(dc);
+}
+
+#ifdef USE_THREADS
+/*
+   A batch runs through the three stages on a thread each, so that
+   file N+1 is read and decoded while file N is interpolated and
+   file N-1 is written.  File i waits in slot i % STAGES, which has
+   a struct dcraw of its own, and next[] says which stage may take
+   each slot.  Every stage sees the files in order, so the output
+   and its names are the same as one file at a time.
+ */
+#define STAGES 3
+
+struct pipeline {
+  struct batch *bp;
+  struct dcraw *dc[STAGES];
+  int next[STAGES], failed[STAGES];
+  int go;			/* -1 if a stage could not be started */
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+};
+
+struct stage {
+  struct pipeline *pp;
+  int stage;
+};
+
+void *run_stage (void *arg)
+{
+  struct stage *sp = arg;
+  struct pipeline *pp = sp->pp;
+  struct dcraw *dc;
+  int i, slot;
+
+  pthread_mutex_lock (&pp->lock);
+  while (!pp->go)
+    pthread_cond_wait (&pp->ready, &pp->lock);
+  pthread_mutex_unlock (&pp->lock);
+  if (pp->go < 0) return 0;
+  for (i=0; i < pp->bp->nfiles; i++) {
+    slot = i % STAGES;
+    pthread_mutex_lock (&pp->lock);
+    while (pp->next[slot] != sp->stage)
+      pthread_cond_wait (&pp->ready, &pp->lock);
+    pthread_mutex_unlock (&pp->lock);
+    dc = pp->dc[slot];
+    if (sp->stage == 0)
+      pp->failed[slot] = load_file (dc, pp->bp->files[i]);
+    else if (!pp->failed[slot]) {
+      if (sp->stage == 1)
+	process_file (dc);
+      else
+	write_file (dc, pp->bp, pp->bp->files[i]);
+    }
+    pthread_mutex_lock (&pp->lock);
+    pp->next[slot] = (sp->stage + 1) % STAGES;
+    pthread_cond_broadcast (&pp->ready);
+    pthread_mutex_unlock (&pp->lock);
+  }
+  return 0;
+}
+
+/*
+   Run the batch through the pipeline, the last stage on this
+   thread.  Returns nonzero, having done nothing, if the threads
+   cannot be started.
+ */
+int run_pipeline (struct dcraw *dc, struct batch *bp)
+{
+  struct pipeline pipe;
+  struct stage stage[STAGES];
+  pthread_t tid[STAGES];
+  int i, n;
+
+  memset (&pipe, 0, sizeof pipe);
+  pipe.bp = bp;
+  pthread_mutex_init (&pipe.lock, 0);
+  pthread_cond_init (&pipe.ready, 0);
+  pipe.dc[0] = dc;
+  for (i=0; i < STAGES; i++) {
+    if (i) {
+      pipe.dc[i] = dcraw_new();
+      merror (pipe.dc[i], "run_pipeline()");
+      copy_options (pipe.dc[i], dc);
+    }
+    stage[i].pp = &pipe;
+    stage[i].stage = i;
+  }
+  for (n=0; n < STAGES-1; n++)
+    if (pthread_create (tid+n, 0, run_stage, stage+n)) break;
+  pthread_mutex_lock (&pipe.lock);
+  pipe.go = n < STAGES-1 ? -1 : 1;
+  pthread_cond_broadcast (&pipe.ready);
+  pthread_mutex_unlock (&pipe.lock);
+  if (pipe.go > 0)
+    run_stage (stage + STAGES-1);
+  for (i=0; i < n; i++)
+    pthread_join (tid[i], 0);
+  for (i=1; i < STAGES; i++)
+    dcraw_free (pipe.dc[i]);
+  pthread_cond_destroy (&pipe.ready);
+  pthread_mutex_destroy (&pipe.lock);
+  return pipe.go < 0;
+}
+#endif
+
+int main(int argc, char **argv)
+{
+  struct dcraw *dc;
+  struct batch batch;
+  int arg, id, identify_only=0, write_to_files=1, minuso=0, compile_bad=0;
   const char *write_ext = ".ppm";
-  FILE *ofp;
+  char *dark_out=0;
 
   if (argc == 1)
   {
@@ -2919,10 +5211,13 @@ int main(int argc, char **argv)
     "\nValid options:"
     "\n-i        Identify files but don't decode them"
     "\n-c        Write to standard output"
+    "\n-e        Extract the embedded JPEG preview, don't decode"
     "\n-o file   Write output to this file"
     "\n-f        Interpolate RGBG as four colors"
     "\n-d        Document Mode (no color, no interpolation)"
     "\n-q        Quick, low-quality color interpolation"
+    "\n-p        Edge-directed color interpolation, faster than VNG"
+    "\n-h        AHD color interpolation, slower and sharper than VNG"
     "\n-g <num>  Set gamma      (0.8 by default, only for 24-bit output)"
     "\n-b <num>  Set brightness (1.0 by default)"
     "\n-w        Use camera white balance settings if possible"
@@ -2931,117 +5226,132 @@ int main(int argc, char **argv)
     "\n-2        Write 24-bit PPM (default)"
     "\n-3        Write 48-bit PSD (Adobe Photoshop)"
     "\n-4        Write 48-bit PPM"
+    "\n-B        Compile .badpixels into .badpixels.bin for faster loading"
+    "\n-H <num>  Add pixels num times brighter or darker than their"
+    "\n          neighbors to .badpixels (2 is a good start)"
+    "\n-D <file> Average the raw files into this master dark frame"
+    "\n-K <file> Subtract this master dark frame"
+    "\n-s        Stream the image through in bands of rows (PPM only)"
+    "\n-S <num>  Use 1/num of the rows for Document Mode white balance"
+    "\n          and for the white point with -s"
+    "\n-j <num>  Use num threads (one per processor by default)"
+    "\n-m <size> Keep memory use under size MB (or add K or G), streaming"
+    "\n          with fewer threads if need be"
+    "\n-L        Put the image in transparent huge pages (Linux)"
     "\n\n", argv[0]);
     exit(1);
   }
 
 /* Parse out the options */
 
-  for (arg=1; argv[arg][0] == '-'; arg++)
+  dc = dcraw_new();
+  merror (dc, "main()");
+
+  for (arg=1; arg < argc && argv[arg][0] == '-'; arg++)
     switch (argv[arg][1])
     {
       case 'i':
 	identify_only = 1;  break;
       case 'c':
 	write_to_files = 0;  break;
+      case 'e':
+	dc->thumbnail_only = 1;  break;
       case 'o':
 	minuso = ++arg;  break;
       case 'f':
-	four_color_rgb = 1;  break;
+	dc->four_color_rgb = 1;  break;
       case 'd':
-	document_mode = 1;  break;
+	dc->document_mode = 1;  break;
       case 'q':
-	quick_interpolate = 1;  break;
+	dc->quick_interpolate = 1;  break;
+      case 'p':
+	dc->edge_interpolate = 1;  break;
+      case 'h':
+	dc->use_ahd = 1;  break;
       case 'g':
-	gamma_val = atof(argv[++arg]);  break;
+	dc->gamma_val = atof(argv[++arg]);  break;
       case 'b':
-	bright = atof(argv[++arg]);  break;
+	dc->bright = atof(argv[++arg]);  break;
       case 'w':
-	use_camera_wb = 1;  break;
+	dc->use_camera_wb = 1;  break;
       case 'r':
-	red_scale = atof(argv[++arg]);  break;
+	dc->red_scale = atof(argv[++arg]);  break;
       case 'l':
-	blue_scale = atof(argv[++arg]);  break;
+	dc->blue_scale = atof(argv[++arg]);  break;
       case '2':
-	write_fun = write_ppm;
+	dc->write_fun = dcraw_write_ppm;
 	write_ext = ".ppm";
 	break;
       case '3':
-	write_fun = write_psd;
+	dc->write_fun = dcraw_write_psd;
 	write_ext = ".psd";
 	break;
       case '4':
-	write_fun = write_ppm16;
+	dc->write_fun = dcraw_write_ppm16;
 	write_ext = ".ppm";
 	break;
+      case 'B':
+	compile_bad = 1;  break;
+      case 'H':
+	dc->hot_ratio = atof(argv[++arg]);  break;
+      case 'D':
+	dark_out = argv[++arg];  break;
+      case 'K':
+	dc->dark_name = argv[++arg];  break;
+      case 's':
+	dc->stream_mode = 1;  break;
+      case 'S':
+	dc->sample_rows = atoi(argv[++arg]);  break;
+      case 'j':
+	dc->nthreads = atoi(argv[++arg]);  break;
+      case 'm':
+	dc->mem_limit = parse_size(argv[++arg]);  break;
+      case 'L':
+	dc->huge_pages = 1;  break;
       default:
 	fprintf (stderr, "Unknown option \"%s\"\n", argv[arg]);
 	exit(1);
     }
+  if (dc->sample_rows < 1) dc->sample_rows = 1;
+  if (dc->thumbnail_only) {
+    dc->write_fun = dcraw_write_thumb;
+    write_ext = ".jpg";
+  }
+  if (compile_bad)
+    compile_badpixels(dc);
+  if (dark_out)
+    return make_dark (dc, dark_out, argc-arg, argv+arg);
 
 /* Process the named files  */
 
+  batch.files = argv + arg;
+  batch.nfiles = argc - arg;
+  batch.write_to_files = write_to_files;
+  batch.write_ext = write_ext;
+  batch.out_name = minuso ? argv[minuso] : 0;
+#ifdef USE_THREADS
+/* The pipeline holds three images at once, so not under -m, and
+   not while -H may be adding to .badpixels between files. */
+  if (!identify_only && batch.nfiles > 1 && !dc->mem_limit &&
+	!dc->hot_ratio && !run_pipeline (dc, &batch))
+    arg = argc;
+#endif
   for ( ; arg < argc; arg++)
   {
-    ifp = fopen(argv[arg],"rb");
-    if (!ifp) perror(argv[arg]);
     if (identify_only) {
-      if (!(id = !ifp || identify(argv[arg])))
-	fprintf (stderr, "%s is a %s %s image.\n", argv[arg], make, model);
-      if (ifp) fclose(ifp);
+      if ((id = dcraw_open (dc, argv[arg]))) perror(argv[arg]);
+      if (!(id = id || dcraw_identify(dc)))
+	fprintf (stderr, "%s is a %s %s image.\n", argv[arg],
+		dc->make, dc->model);
+      dcraw_close(dc);
       if (arg+1 < argc) continue;
       exit(id);
     }
-    if (!ifp) continue;
-    if (identify(argv[arg])) {
-      fclose(ifp);
-      continue;
-    }
-    image = calloc (height * width, sizeof *image);
-    merror (image, "main()");
-    fprintf (stderr, "Loading %s %s image from %s...\n",
-	make, model, argv[arg]);
-    (*load_raw)();
-    fclose(ifp);
-    if (is_foveon) {
-      fprintf (stderr, "Foveon interpolation...\n");
-      foveon_interpolate();
-    } else {
-      bad_pixels();
-      fprintf (stderr, "Scaling raw data (black=%d)...\n", black);
-      if (document_mode)
-	auto_scale();
-      scale_colors();
-    }
-    trim = 0;
-    if (filters && !document_mode) {
-      trim = 1;
-      fprintf (stderr, "%s interpolation...\n",
-	quick_interpolate ? "Bilinear":"VNG");
-      vng_interpolate();
-    }
-    fprintf (stderr, "Converting to RGB colorspace...\n");
-    convert_to_rgb();
-    ofp = stdout;
-    strcpy (data, "standard output");
-    if (write_to_files) {
-      strcpy (data, argv[arg]);
-      if ((cp = strrchr (data, '.'))) *cp = 0;
-      strcat (data, write_ext);
-      if (minuso)
-	strcpy (data, argv[minuso]);
-      ofp = fopen (data, "wb");
-      if (!ofp) {
-	perror(data);
-	continue;
-      }
-    }
-    fprintf (stderr, "Writing data to %s...\n", data);
-    (*write_fun)(ofp);
-    if (write_to_files)
-      fclose(ofp);
-
-    free(image);
+    if (load_file (dc, argv[arg])) continue;
+    process_file (dc);
+    write_file (dc, &batch, argv[arg]);
   }
+  dcraw_free(dc);
   return 0;
 }
+#endif /* NO_MAIN */
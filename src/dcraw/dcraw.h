@@ -0,0 +1,165 @@
+/*
+   dcraw.h -- the decoder in dcraw.c as a library
+
+   Compile dcraw.c with -DNO_MAIN to link it into another program.
+   An image is decoded in stages, each a call that returns zero on
+   success:
+
+	dc = dcraw_new();
+	dcraw_open (dc, "image.crw");	(or dcraw_open_fd, dcraw_open_buffer)
+	dcraw_identify (dc);		dc->make, dc->model, dc->width ...
+	dcraw_load_raw (dc);
+	dcraw_preprocess (dc);
+	dcraw_interpolate (dc);
+	dcraw_convert (dc);
+	dcraw_write (dc, ofp);		(or dcraw_write_cb, dcraw_write_buffer)
+	dcraw_close (dc);		ready for the next dcraw_open()
+	dcraw_free (dc);
+
+   Call the stages in that order, skipping from dcraw_identify() to
+   dcraw_write() only to extract the preview (thumbnail_only).
+   Options are the fields under "Options" below.  Set them before
+   dcraw_identify(), which already acts on thumbnail_only, write_fun,
+   use_camera_wb, red_scale, blue_scale and four_color_rgb.  Each
+   struct dcraw decodes one image at a time; use one per thread to
+   decode several at once.
+
+   If progress is set, it is called as each stage starts and ends
+   and as each band is written, and can cancel the decode by
+   returning nonzero.  dcraw_cancel() does the same from any thread.
+   Either way the stage running returns nonzero.  Messages still go
+   to stderr, and running out of memory still ends the process.
+ */
+
+#ifndef DCRAW_H
+#define DCRAW_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#ifdef WIN32
+typedef __int64 dcraw_int64;
+#else
+typedef long long dcraw_int64;
+#endif
+
+struct dcraw_decode {
+  struct dcraw_decode *branch[2];
+  int leaf;
+};
+
+/*
+   A read-only window onto part of a file.  Where possible the
+   file is mapped into memory, otherwise the bytes are read in.
+ */
+struct dcraw_view {
+  unsigned char *data;		/* The bytes asked for */
+  char *base;		/* Start of the mapping, or NULL */
+  size_t size;		/* Length of the mapping */
+};
+
+/*
+   Memory kept from one image to the next, so that a batch of files
+   the same size allocates and faults it in only once.
+ */
+struct dcraw_block {
+  void *mem;
+  size_t size;
+};
+
+/*
+   What the progress callback is told is under way.
+ */
+enum dcraw_stage {
+  DCRAW_LOAD, DCRAW_PREPROCESS, DCRAW_INTERPOLATE, DCRAW_CONVERT, DCRAW_WRITE
+};
+
+/*
+   Everything about one image and how to decode it.  Every function
+   that needs any of it is passed a pointer, so several images can be
+   decoded at once on separate threads, one struct dcraw each.
+ */
+struct dcraw {
+  FILE *ifp;
+  char *ifname;			/* For messages and .badpixels */
+  short order;
+  char make[64], model[64], model2[64];
+  int raw_height, raw_width;	/* Including black borders */
+  int timestamp;
+  int tiff_data_offset, tiff_data_compression;
+  int thumb_offset, thumb_length;
+  int kodak_data_compression;
+  int nef_curve_offset;
+  int height, width, colors, black, rgb_max;
+  int is_canon, is_cmy, is_foveon, use_coeff, trim, ymag;
+  unsigned filters;
+  unsigned char fcol[8][2];
+  unsigned short (*image)[4], *raw_image;
+  void (*load_raw)(struct dcraw *);
+  float camera_red, camera_blue;
+  float pre_mul[4], coeff[3][4];
+  int histogram[0x2000];
+  int stream;			/* Interpolate and write in bands */
+  int band_rows, band_threads;	/* What -m leaves room for */
+
+/* Options */
+  float gamma_val, bright, red_scale, blue_scale;
+  int four_color_rgb, use_camera_wb, document_mode, quick_interpolate;
+  int edge_interpolate, use_ahd, stream_mode;
+  int thumbnail_only;
+  float hot_ratio;
+  char *dark_name;
+  int nthreads, sample_rows, huge_pages;
+  dcraw_int64 mem_limit;
+  void (*write_fun)(struct dcraw *, FILE *);
+
+/* Progress, cancellation and output */
+  int (*progress)(void *arg, enum dcraw_stage stage, int done, int total);
+  void *progress_arg;		/* Nonzero from progress() cancels */
+  volatile int cancelled;
+  size_t (*out)(void *arg, const void *data, size_t len);
+  void *out_arg;
+
+/* Kept from one call to the next */
+  struct dcraw_decode first_decode[32], second_decode[512];
+  struct dcraw_decode *free_decode;	/* Next unused node */
+  int leaf;			/* Leaves make_decoder() has added */
+  unsigned long bitbuf;		/* getbits() */
+  int vbits;
+  int carry, pixel, base[2];	/* decompress() */
+  struct dcraw_badpix *badpix;	/* The .badpixels list */
+  int nbadpix;			/* -1 until the search has been done */
+  char *badpix_dir;		/* Where the list was found */
+  struct dcraw_badpix *fix;		/* bad_pixels() for the last image size */
+  unsigned short *fixval;
+  int nfix, fix_key[4];
+  struct dcraw_view dark_view;	/* load_dark() */
+  struct dcraw_dark_head *dark_head;
+  struct dcraw_block plane;		/* Holds raw_image[] or image[] */
+  struct dcraw_block scratch;		/* A second image-sized buffer */
+};
+
+struct dcraw *dcraw_new (void);
+void dcraw_free (struct dcraw *dc);
+int  dcraw_open (struct dcraw *dc, const char *fname);
+int  dcraw_open_fd (struct dcraw *dc, int fd, const char *name);
+int  dcraw_open_buffer (struct dcraw *dc, const void *data, size_t size,
+	const char *name);
+int  dcraw_identify (struct dcraw *dc);
+int  dcraw_load_raw (struct dcraw *dc);
+int  dcraw_preprocess (struct dcraw *dc);
+int  dcraw_interpolate (struct dcraw *dc);
+int  dcraw_convert (struct dcraw *dc);
+int  dcraw_write (struct dcraw *dc, FILE *ofp);
+int  dcraw_write_cb (struct dcraw *dc,
+	size_t (*out)(void *arg, const void *data, size_t len), void *arg);
+int  dcraw_write_buffer (struct dcraw *dc, void **data, size_t *size);
+void dcraw_cancel (struct dcraw *dc);
+void dcraw_close (struct dcraw *dc);
+
+void dcraw_write_ppm (struct dcraw *dc, FILE *ofp);
+void dcraw_write_ppm16 (struct dcraw *dc, FILE *ofp);
+void dcraw_write_psd (struct dcraw *dc, FILE *ofp);
+void dcraw_write_thumb (struct dcraw *dc, FILE *ofp);
+
+#endif /* DCRAW_H */